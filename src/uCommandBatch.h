@@ -0,0 +1,464 @@
+#pragma once
+#include "Particle.h"
+#include "uTypedef.h"
+#include "uPlainCommHandler.h"
+#include <vector>
+#include <algorithm>
+
+/**
+ * @brief batch of variable assignments that is validated completely before any of it is applied
+ * values are parsed ("staged") when they are added, applying the batch then cannot fail for staged
+ * values and the change notifications are delivered once per variable after all values are set
+ * @note values of types without a staged parser (e.g. TIME) are set via setValue() first and rolled
+ * back if any of them fails, they notify when they are set
+ * @note values can be text (parsed for the variable's type) or typed (e.g. decoded from CBOR)
+ * @note the batch does not copy the command texts or values, they must outlive the batch
+ */
+class TcommandBatch
+{
+
+public:
+    // code of a valid command that was not applied because other commands in the batch failed
+    constexpr static int NOT_APPLIED = -1;
+
+    /**
+     * @brief parsed value
+     */
+    union TstagedValue
+    {
+        dtypes::int64 Fint;
+        dtypes::uint64 Fuint;
+        dtypes::float64 Ffloat;
+    };
+
+    /**
+     * @brief single assignment
+     */
+    struct Tcommand
+    {
+        const char *Fcmd;     // full command text (for logging)
+        size_t FcmdLength;    // length of the command text
+        Tdescr *Fvar;         // target variable
+        const char *Fvalue;   // value text
+        TstagedValue Fstaged; // parsed value
+        bool Fdeferred;       // no staged parser, value is set via setValue()
+        int Fcode;            // 0 = ok, otherwise plainComm error code or NOT_APPLIED
+    };
+
+private:
+    std::vector<Tcommand> Fcmds;
+    size_t Ffailed = 0;
+    size_t Fchanged = 0;
+
+    /**
+     * @brief parse a text value with the parser of the variable type itself (setValue() of a scratch
+     * descriptor, so the target is not touched and nothing is notified), i.e. exactly like sdds does
+     */
+    template <typename T, typename S>
+    static bool parseAs(const char *_value, S &_result)
+    {
+        T scratch;
+        if (!scratch.setValue(_value))
+            return false;
+        _result = scratch.Fvalue;
+        return true;
+    }
+
+    /**
+     * @brief enum value by name or by number (enums have no scratch descriptor, their names are the enum's own table)
+     */
+    static bool parseEnum(TenumBase *_en, const char *_value, dtypes::uint64 &_result)
+    {
+        dtypes::uint64 n = 0;
+        for (auto it = _en->enumInfo().iterator;; ++n)
+        {
+            if (strcmp(it.next(), _value) == 0)
+            {
+                _result = n;
+                return true;
+            }
+            if (!it.hasNext())
+                break;
+        }
+        dtypes::uint8 number;
+        if (!parseAs<Tuint8>(_value, number) || number > n)
+            return false;
+        _result = number;
+        return true;
+    }
+
+    /**
+     * @brief parse the value for the variable's type
+     * @return whether the value is valid (always true for deferred values)
+     */
+    static bool stage(Tcommand &_cmd)
+    {
+        _cmd.Fdeferred = false;
+        switch (_cmd.Fvar->type())
+        {
+        case sdds::Ttype::UINT8:
+            return parseAs<Tuint8>(_cmd.Fvalue, _cmd.Fstaged.Fuint);
+        case sdds::Ttype::UINT16:
+            return parseAs<Tuint16>(_cmd.Fvalue, _cmd.Fstaged.Fuint);
+        case sdds::Ttype::UINT32:
+            return parseAs<Tuint32>(_cmd.Fvalue, _cmd.Fstaged.Fuint);
+        case sdds::Ttype::INT8:
+            return parseAs<Tint8>(_cmd.Fvalue, _cmd.Fstaged.Fint);
+        case sdds::Ttype::INT16:
+            return parseAs<Tint16>(_cmd.Fvalue, _cmd.Fstaged.Fint);
+        case sdds::Ttype::INT32:
+            return parseAs<Tint32>(_cmd.Fvalue, _cmd.Fstaged.Fint);
+        case sdds::Ttype::FLOAT32:
+            return parseAs<Tfloat32>(_cmd.Fvalue, _cmd.Fstaged.Ffloat);
+        case sdds::Ttype::FLOAT64:
+            return parseAs<Tfloat64>(_cmd.Fvalue, _cmd.Fstaged.Ffloat);
+        case sdds::Ttype::ENUM:
+            return parseEnum(static_cast<TenumBase *>(_cmd.Fvar), _cmd.Fvalue, _cmd.Fstaged.Fuint);
+        case sdds::Ttype::STRING:
+            return true;
+        default:
+            _cmd.Fdeferred = true;
+            return true;
+        }
+    }
+
+    /**
+     * @brief take a typed (numeric or boolean) value for the variable's type
+     * @return whether the value is valid for the type
+     */
+    static bool stage(Tcommand &_cmd, const Variant &_value)
+    {
+        _cmd.Fdeferred = false;
+        bool isInteger = _value.isBool() || _value.isInt() || _value.isUInt() || _value.isInt64() || _value.isUInt64();
+        bool isNegative = (_value.isInt() || _value.isInt64()) && _value.toInt64() < 0;
+        dtypes::int64 i = _value.toInt64();
+        dtypes::uint64 u = (isNegative) ? 0 : _value.toUInt64();
+        switch (_cmd.Fvar->type())
+        {
+        case sdds::Ttype::UINT8:
+        case sdds::Ttype::UINT16:
+        case sdds::Ttype::UINT32:
+        {
+            dtypes::uint64 max = (_cmd.Fvar->type() == sdds::Ttype::UINT8) ? UINT8_MAX : (_cmd.Fvar->type() == sdds::Ttype::UINT16) ? UINT16_MAX
+                                                                                                                                     : UINT32_MAX;
+            _cmd.Fstaged.Fuint = u;
+            return isInteger && !isNegative && u <= max;
+        }
+        case sdds::Ttype::INT8:
+            _cmd.Fstaged.Fint = i;
+            return isInteger && i >= INT8_MIN && i <= INT8_MAX;
+        case sdds::Ttype::INT16:
+            _cmd.Fstaged.Fint = i;
+            return isInteger && i >= INT16_MIN && i <= INT16_MAX;
+        case sdds::Ttype::INT32:
+            _cmd.Fstaged.Fint = i;
+            return isInteger && i >= INT32_MIN && i <= INT32_MAX;
+        case sdds::Ttype::FLOAT32:
+        case sdds::Ttype::FLOAT64:
+            _cmd.Fstaged.Ffloat = _value.toDouble();
+            return _value.isNumber();
+        case sdds::Ttype::ENUM:
+        {
+            // number of the enum value
+            dtypes::uint64 n = 0;
+            for (auto it = static_cast<TenumBase *>(_cmd.Fvar)->enumInfo().iterator;;)
+            {
+                it.next();
+                n++;
+                if (!it.hasNext())
+                    break;
+            }
+            _cmd.Fstaged.Fuint = u;
+            return isInteger && !isNegative && u < n;
+        }
+        default:
+            // strings, times, etc. need a text value
+            return false;
+        }
+    }
+
+    /**
+     * @brief set the staged value (without notifications)
+     */
+    static void apply(const Tcommand &_cmd)
+    {
+        Tdescr *d = _cmd.Fvar;
+        switch (d->type())
+        {
+        case sdds::Ttype::UINT8:
+            static_cast<Tuint8 *>(d)->Fvalue = _cmd.Fstaged.Fuint;
+            break;
+        case sdds::Ttype::UINT16:
+            static_cast<Tuint16 *>(d)->Fvalue = _cmd.Fstaged.Fuint;
+            break;
+        case sdds::Ttype::UINT32:
+            static_cast<Tuint32 *>(d)->Fvalue = _cmd.Fstaged.Fuint;
+            break;
+        case sdds::Ttype::INT8:
+            static_cast<Tint8 *>(d)->Fvalue = _cmd.Fstaged.Fint;
+            break;
+        case sdds::Ttype::INT16:
+            static_cast<Tint16 *>(d)->Fvalue = _cmd.Fstaged.Fint;
+            break;
+        case sdds::Ttype::INT32:
+            static_cast<Tint32 *>(d)->Fvalue = _cmd.Fstaged.Fint;
+            break;
+        case sdds::Ttype::FLOAT32:
+            static_cast<Tfloat32 *>(d)->Fvalue = _cmd.Fstaged.Ffloat;
+            break;
+        case sdds::Ttype::FLOAT64:
+            static_cast<Tfloat64 *>(d)->Fvalue = _cmd.Fstaged.Ffloat;
+            break;
+        case sdds::Ttype::ENUM:
+            *static_cast<dtypes::uint8 *>(static_cast<TenumBase *>(d)->pValue()) = _cmd.Fstaged.Fuint;
+            break;
+        case sdds::Ttype::STRING:
+            static_cast<Tstring *>(d)->Fvalue = _cmd.Fvalue;
+            break;
+        default:
+            break;
+        }
+    }
+
+    /**
+     * @brief the raw value of a variable with a staged type (strings are compared by their text)
+     */
+    static TstagedValue rawValue(Tdescr *_d)
+    {
+        TstagedValue raw;
+        memset(&raw, 0, sizeof(raw));
+        switch (_d->type())
+        {
+        case sdds::Ttype::UINT8:
+            raw.Fuint = static_cast<Tuint8 *>(_d)->Fvalue;
+            break;
+        case sdds::Ttype::UINT16:
+            raw.Fuint = static_cast<Tuint16 *>(_d)->Fvalue;
+            break;
+        case sdds::Ttype::UINT32:
+            raw.Fuint = static_cast<Tuint32 *>(_d)->Fvalue;
+            break;
+        case sdds::Ttype::INT8:
+            raw.Fint = static_cast<Tint8 *>(_d)->Fvalue;
+            break;
+        case sdds::Ttype::INT16:
+            raw.Fint = static_cast<Tint16 *>(_d)->Fvalue;
+            break;
+        case sdds::Ttype::INT32:
+            raw.Fint = static_cast<Tint32 *>(_d)->Fvalue;
+            break;
+        case sdds::Ttype::FLOAT32:
+            raw.Ffloat = static_cast<Tfloat32 *>(_d)->Fvalue; // exact in a double
+            break;
+        case sdds::Ttype::FLOAT64:
+            raw.Ffloat = static_cast<Tfloat64 *>(_d)->Fvalue;
+            break;
+        case sdds::Ttype::ENUM:
+            raw.Fuint = *static_cast<dtypes::uint8 *>(static_cast<TenumBase *>(_d)->pValue());
+            break;
+        default:
+            break;
+        }
+        return raw;
+    }
+
+    void rejectAll()
+    {
+        for (size_t i = 0; i < Fcmds.size(); ++i)
+        {
+            if (Fcmds[i].Fcode == 0)
+                Fcmds[i].Fcode = NOT_APPLIED;
+        }
+    }
+
+public:
+    // constructor
+    TcommandBatch()
+    {
+    }
+
+    void reserve(size_t _n)
+    {
+        Fcmds.reserve(_n);
+    }
+
+    /**
+     * @brief add an assignment to the batch and validate it
+     * @param _var target variable (nullptr if the path could not be resolved)
+     * @param _value the value (nullptr if the command is not an assignment)
+     * @return whether the command is valid
+     */
+    bool add(const char *_cmd, size_t _cmdLength, Tdescr *_var, const char *_value)
+    {
+        Tcommand cmd{_cmd, _cmdLength, _var, _value, {0}, false, 0};
+        if (!_var || _var->isStruct())
+            cmd.Fcode = plainComm::Terror::toInt(plainComm::Terror::e::invalidPath);
+        else if (!_value || _var->isReadonly() || !stage(cmd))
+            cmd.Fcode = plainComm::Terror::toInt(plainComm::Terror::e::invalidValue);
+        if (cmd.Fcode != 0)
+            Ffailed++;
+        Fcmds.push_back(cmd);
+        return (cmd.Fcode == 0);
+    }
+
+    /**
+     * @brief add a typed assignment (numeric or boolean value) to the batch and validate it
+     * @param _var target variable (nullptr if it could not be resolved)
+     * @return whether the command is valid
+     */
+    bool add(const char *_cmd, size_t _cmdLength, Tdescr *_var, const Variant &_value)
+    {
+        Tcommand cmd{_cmd, _cmdLength, _var, nullptr, {0}, false, 0};
+        if (!_var || _var->isStruct())
+            cmd.Fcode = plainComm::Terror::toInt(plainComm::Terror::e::invalidPath);
+        else if (_var->isReadonly() || !stage(cmd, _value))
+            cmd.Fcode = plainComm::Terror::toInt(plainComm::Terror::e::invalidValue);
+        if (cmd.Fcode != 0)
+            Ffailed++;
+        Fcmds.push_back(cmd);
+        return (cmd.Fcode == 0);
+    }
+
+    size_t size() const { return Fcmds.size(); }
+    size_t failed() const { return Ffailed; }
+    size_t changed() const { return Fchanged; } // variables whose value changed (after execute())
+    const Tcommand &operator[](size_t _i) const { return Fcmds[_i]; }
+
+    /**
+     * @brief apply all assignments (only if all of them are valid) and notify each variable whose value
+     * changed once (assignments of the current value do not notify, like single commands)
+     * @return whether the batch was applied
+     */
+    bool execute()
+    {
+        if (Fcmds.empty())
+            return false;
+        if (Ffailed > 0)
+        {
+            rejectAll();
+            return false;
+        }
+
+        // deferred values first (the only ones that can still fail)
+        std::vector<dtypes::string> previous;
+        for (size_t i = 0; i < Fcmds.size(); ++i)
+        {
+            if (!Fcmds[i].Fdeferred)
+                continue;
+            previous.push_back(Fcmds[i].Fvar->to_string());
+            if (!Fcmds[i].Fvar->setValue(Fcmds[i].Fvalue))
+            {
+                // roll back the deferred values that were already set
+                Fcmds[i].Fcode = plainComm::Terror::toInt(plainComm::Terror::e::invalidValue);
+                Ffailed++;
+                previous.pop_back();
+                for (size_t j = i; j-- > 0;)
+                {
+                    if (!Fcmds[j].Fdeferred)
+                        continue;
+                    Fcmds[j].Fvar->setValue(previous.back().c_str());
+                    previous.pop_back();
+                }
+                rejectAll();
+                return false;
+            }
+        }
+
+        // staged values (keep the raw value from before the batch of each targeted variable)
+        struct Tbefore
+        {
+            Tdescr *Fvar;
+            TstagedValue Fraw;
+            dtypes::string Ftext; // strings only
+        };
+        std::vector<Tbefore> before;
+        for (size_t i = 0; i < Fcmds.size(); ++i)
+        {
+            if (Fcmds[i].Fdeferred)
+                continue;
+            Tdescr *d = Fcmds[i].Fvar;
+            if (std::find_if(before.begin(), before.end(), [d](const Tbefore &_b)
+                             { return _b.Fvar == d; }) == before.end())
+                before.push_back({d, rawValue(d), (d->type() == sdds::Ttype::STRING) ? static_cast<Tstring *>(d)->Fvalue : dtypes::string()});
+            apply(Fcmds[i]);
+        }
+
+        // notify once per variable whose value changed (compared raw, not by its formatted text)
+        Fchanged = 0;
+        for (Tbefore &b : before)
+        {
+            TstagedValue raw = rawValue(b.Fvar);
+            bool same = (b.Fvar->type() == sdds::Ttype::STRING) ? (static_cast<Tstring *>(b.Fvar)->Fvalue == b.Ftext) : (memcmp(&raw, &b.Fraw, sizeof(raw)) == 0);
+            if (same)
+                continue;
+            b.Fvar->signalEvents();
+            Fchanged++;
+        }
+        return true;
+    }
+#ifdef SDDS_PARTICLE_DEBUG
+    /**
+     * @brief on-device checks of the value parsing and change notification edge cases (debug action testBatch)
+     * @return the number of failed checks (each one is logged)
+     */
+    static size_t selfTest()
+    {
+        size_t failed = 0;
+        auto check = [&failed](bool _ok, const char *_what)
+        {
+            if (_ok)
+                return;
+            failed++;
+            Log.error("batch check failed: %s", _what);
+        };
+        // staged values are parsed exactly like setValue() does it
+        const char *inputs[] = {"-12", "255", "256", "+5", " 5", "1.5", "2.5E-3", "0x10", "", "x"};
+        for (const char *input : inputs)
+        {
+            Tint16 direct, target;
+            bool valid = direct.setValue(input);
+            TcommandBatch batch;
+            check(batch.add("v", 1, &target, input) == valid && (!valid || (batch.execute() && target.Fvalue == direct.Fvalue)), input);
+            Tfloat32 directF, targetF;
+            valid = directF.setValue(input);
+            TcommandBatch batchF;
+            check(batchF.add("f", 1, &targetF, input) == valid && (!valid || (batchF.execute() && targetF.Fvalue == directF.Fvalue)), input);
+        }
+
+        // change notifications
+        Tint32 var;
+        var.Fvalue = 5;
+        {
+            TcommandBatch batch;
+            batch.add("v=5", 3, &var, "5");
+            check(batch.execute() && batch.changed() == 0, "same value does not notify");
+        }
+        {
+            TcommandBatch batch;
+            batch.add("v=6", 3, &var, "6");
+            check(batch.execute() && batch.changed() == 1 && var.Fvalue == 6, "new value notifies");
+        }
+        {
+            TcommandBatch batch;
+            batch.add("v=7", 3, &var, "7");
+            batch.add("v=6", 3, &var, "6");
+            check(batch.execute() && batch.changed() == 0 && var.Fvalue == 6, "value restored within the batch does not notify");
+        }
+        {
+            TcommandBatch batch;
+            batch.add("v=8", 3, &var, "8");
+            batch.add("v=x", 3, &var, "x");
+            check(!batch.execute() && var.Fvalue == 6, "invalid value rejects the batch");
+        }
+        {
+            // changes below the text formatting precision still notify
+            Tfloat32 f;
+            f.Fvalue = 1.0f;
+            TcommandBatch batch;
+            batch.add("f=1.0000001", 11, &f, "1.0000001");
+            check(batch.execute() && (f.Fvalue == 1.0f || batch.changed() == 1), "small float change notifies");
+        }
+        return failed;
+    }
+#endif
+};
@@ -0,0 +1,193 @@
+#pragma once
+#include "Particle.h"
+#include "uTypedef.h"
+#include "uStringHash.h"
+
+/**
+ * @brief small ring of the most recently queued (CBOR encoded) bursts plus the last system counters,
+ * kept in retained (backup) RAM so they survive a PANIC, watchdog or out-of-memory restart
+ * each kept burst gets a ticket that the publisher keeps with the queued burst and hands back with done()
+ * once it was sent (or moved elsewhere), only the pending ones are recovered
+ * @note the instance lives in retained RAM (see crashRing()) and must not have a constructor that
+ * initializes anything, call setup() at boot instead
+ * @note every slot has its own checksum, so a change only rehashes the header and that one slot
+ * @note optional, only compiled with SDDS_PARTICLE_CRASH_RING (takes ~2 kB of retained RAM)
+ */
+class TcrashRing
+{
+
+public:
+    constexpr static size_t N_SLOTS = 4;     // most recent bursts
+    constexpr static size_t SLOT_SIZE = 480; // max encoded burst size (larger bursts are not kept)
+
+    // last system counters
+    struct Tcounters
+    {
+        dtypes::uint32 Fuptime_s;
+        dtypes::uint32 FfreeRAM_byte;
+        dtypes::uint32 FmonitorMax_us;
+        dtypes::uint32 FwatchdogGapMax_ms;
+        dtypes::uint32 Fqueued;
+        dtypes::uint8 FmemoryStage;
+    };
+
+private:
+    constexpr static dtypes::uint32 MAGIC = 0x53444443; // SDDC
+
+    struct Tslot
+    {
+        dtypes::uint32 Fchecksum; // of the fields below (data only up to its length)
+        dtypes::uint32 Fticket;   // of the burst in this slot
+        dtypes::uint16 Flength;   // 0 = empty
+        bool Fpending;            // not sent yet
+        dtypes::uint8 Fdata[SLOT_SIZE];
+
+        dtypes::uint32 checksum() const
+        {
+            const char *start = reinterpret_cast<const char *>(&Fticket);
+            size_t length = offsetof(Tslot, Fdata) - offsetof(Tslot, Fticket) + std::min<size_t>(Flength, SLOT_SIZE);
+            return fold(TstringHash::hash(start, length));
+        }
+
+        void seal()
+        {
+            Fchecksum = checksum();
+        }
+    };
+
+    dtypes::uint32 Fmagic;
+    dtypes::uint32 Fchecksum;   // of the header fields below (the slots have their own)
+    dtypes::uint8 Fnext;        // slot for the next burst (= oldest slot)
+    dtypes::uint32 FlastTicket; // ticket of the most recently kept burst
+    Tcounters Fcounters;
+    Tslot Fslots[N_SLOTS];
+
+    static dtypes::uint32 fold(dtypes::uint64 _hash)
+    {
+        return static_cast<dtypes::uint32>(_hash ^ (_hash >> 32));
+    }
+
+    dtypes::uint32 checksum() const
+    {
+        const char *start = reinterpret_cast<const char *>(&Fnext);
+        const char *end = reinterpret_cast<const char *>(&Fslots);
+        return fold(TstringHash::hash(start, end - start));
+    }
+
+    void seal()
+    {
+        Fchecksum = checksum();
+    }
+
+public:
+    /**
+     * @brief validate the retained data (cleared if it's not valid, e.g. after a power loss)
+     * @return whether the retained data was valid
+     */
+    bool setup()
+    {
+        bool valid = Fmagic == MAGIC && Fchecksum == checksum() && Fnext < N_SLOTS;
+        for (const Tslot &slot : Fslots)
+            valid = valid && slot.Flength <= SLOT_SIZE && slot.Fchecksum == slot.checksum();
+        if (valid)
+            return true;
+        clear();
+        return false;
+    }
+
+    void clear()
+    {
+        memset(this, 0, sizeof(*this));
+        Fmagic = MAGIC;
+        seal();
+        for (Tslot &slot : Fslots)
+            slot.seal();
+    }
+
+    /**
+     * @brief keep an encoded burst (overwrites the oldest one)
+     * @return the burst's ticket for done() (0 if the burst is not kept)
+     */
+    dtypes::uint32 add(const String &_cbor)
+    {
+        if (_cbor.length() == 0 || _cbor.length() > SLOT_SIZE)
+            return 0;
+        Tslot &slot = Fslots[Fnext];
+        memcpy(slot.Fdata, _cbor.c_str(), _cbor.length());
+        slot.Flength = _cbor.length();
+        slot.Fpending = true;
+        if (++FlastTicket == 0)
+            FlastTicket = 1; // 0 = no ticket
+        slot.Fticket = FlastTicket;
+        slot.seal();
+        Fnext = (Fnext + 1) % N_SLOTS;
+        seal();
+        return slot.Fticket;
+    }
+
+    /**
+     * @brief mark the burst with this ticket as done (no-op if it was overwritten already or for ticket 0)
+     */
+    void done(dtypes::uint32 _ticket)
+    {
+        if (_ticket == 0)
+            return;
+        for (Tslot &slot : Fslots)
+        {
+            if (slot.Fpending && slot.Fticket == _ticket)
+            {
+                slot.Fpending = false;
+                slot.seal();
+                return;
+            }
+        }
+    }
+
+    void setCounters(const Tcounters &_counters)
+    {
+        Fcounters = _counters;
+        seal();
+    }
+
+    const Tcounters &counters() const { return Fcounters; }
+
+    /**
+     * @brief number of pending bursts
+     */
+    size_t pending() const
+    {
+        size_t n = 0;
+        for (const Tslot &slot : Fslots)
+            n += (slot.Fpending) ? 1 : 0;
+        return n;
+    }
+
+    /**
+     * @brief the i-th pending burst (oldest first)
+     * @return false if there is no such burst
+     */
+    bool pendingBurst(size_t _i, String &_cbor) const
+    {
+        for (size_t i = 0; i < N_SLOTS; ++i)
+        {
+            const Tslot &slot = Fslots[(Fnext + i) % N_SLOTS];
+            if (!slot.Fpending)
+                continue;
+            if (_i-- == 0)
+            {
+                _cbor = String(reinterpret_cast<const char *>(slot.Fdata), slot.Flength);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+/**
+ * @brief the crash ring in retained RAM
+ */
+retained TcrashRing sddsCrashRing;
+TcrashRing &crashRing()
+{
+    return sddsCrashRing;
+}
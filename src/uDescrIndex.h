@@ -0,0 +1,224 @@
+#pragma once
+#include "uTypedef.h"
+#include "uStringHash.h"
+#include <vector>
+
+/**
+ * @brief flat, depth-first index of an sdds tree (built once, the tree structure is static after setup)
+ * the position of an entry in the index is its stable numeric id, the entries of a struct's
+ * subtree directly follow the struct entry so any subtree is a contiguous range
+ * the full paths are hashed into an open addressing table for O(path length) lookups by path
+ */
+class TdescrIndex
+{
+
+public:
+    // id for "not in the index" / "no parent"
+    constexpr static size_t NONE = static_cast<size_t>(-1);
+
+    // ids within the index (32 bit so large trees cannot overflow the parent/end ids or the path table)
+    typedef dtypes::uint32 Tid;
+
+    /**
+     * @brief single descriptor in the index
+     */
+    struct Tentry
+    {
+        Tdescr *Fdescr;        // the descriptor
+        Tid Fparent;           // id of the parent struct (NO_PARENT for top level entries)
+        Tid Fend;              // id after the last entry of the subtree (own id + 1 if not a struct)
+        dtypes::uint8 Fdepth;  // 0 for top level entries
+        sdds::Ttype Ftype;     // data type
+        dtypes::uint8 Foption; // option bits
+
+        bool isStruct() const { return Ftype == sdds::Ttype::STRUCT; }
+    };
+    constexpr static Tid NO_PARENT = 0xFFFFFFFF;
+
+    /**
+     * @brief range of ids [Ffirst, Fend)
+     */
+    struct Trange
+    {
+        size_t Ffirst;
+        size_t Fend;
+    };
+
+private:
+    std::vector<Tentry> Fentries;
+    TmenuHandle *Froot = nullptr;
+
+    // path lookup table
+    std::vector<dtypes::uint64> FpathHashes; // hash of the full path of each entry
+    std::vector<Tid> Fslots;                 // id + 1 (0 = empty slot)
+    size_t FslotsMask = 0;
+
+    /**
+     * @brief hash of the full path ("a.b.c") of an entry, continued from its parent's path hash
+     */
+    dtypes::uint64 pathHash(Tdescr *_d, Tid _parent)
+    {
+        TstringHash h;
+        if (_parent != NO_PARENT)
+        {
+            h = TstringHash(FpathHashes[_parent]);
+            h.add('.');
+        }
+        const char *name = _d->name();
+        h.add(name, strlen(name));
+        return h.value();
+    }
+
+    /**
+     * @brief whether the path of an entry is exactly _path (walks up the parents, last segment first)
+     */
+    bool matchesPath(size_t _id, const char *_path, size_t _length) const
+    {
+        const char *end = _path + _length;
+        for (Tid id = static_cast<Tid>(_id); id != NO_PARENT; id = Fentries[id].Fparent)
+        {
+            const char *name = Fentries[id].Fdescr->name();
+            size_t nameLength = strlen(name);
+            if (static_cast<size_t>(end - _path) < nameLength || strncmp(end - nameLength, name, nameLength) != 0)
+                return false;
+            end -= nameLength;
+            if (Fentries[id].Fparent == NO_PARENT)
+                break;
+            if (end == _path || *(--end) != '.')
+                return false;
+        }
+        return end == _path;
+    }
+
+    void buildPathTable()
+    {
+        size_t n = 1;
+        while (n < 2 * Fentries.size())
+            n <<= 1;
+        Fslots.assign(n, 0);
+        FslotsMask = n - 1;
+        for (size_t i = 0; i < Fentries.size(); ++i)
+        {
+            size_t slot = FpathHashes[i] & FslotsMask;
+            while (Fslots[slot] != 0)
+                slot = (slot + 1) & FslotsMask;
+            Fslots[slot] = static_cast<Tid>(i + 1);
+        }
+    }
+
+    void addEntries(TmenuHandle *_struct, dtypes::uint8 _depth, Tid _parent)
+    {
+        for (auto it = _struct->iterator(); it.hasCurrent(); it.jumpToNext())
+        {
+            Tdescr *d = it.current();
+            if (!d)
+                continue;
+            size_t id = Fentries.size();
+            Fentries.push_back({d, _parent, static_cast<Tid>(id + 1), _depth, d->type(), d->option()});
+            FpathHashes.push_back(pathHash(d, _parent));
+            if (d->isStruct())
+            {
+                TmenuHandle *mh = static_cast<Tstruct *>(d)->value();
+                if (mh)
+                    addEntries(mh, _depth + 1, static_cast<Tid>(id));
+                Fentries[id].Fend = static_cast<Tid>(Fentries.size());
+            }
+        }
+    }
+
+public:
+    // constructor
+    TdescrIndex()
+    {
+    }
+
+    /**
+     * @brief (re)build the index for the tree
+     */
+    void build(TmenuHandle *_root)
+    {
+        Froot = _root;
+        Fentries.clear();
+        FpathHashes.clear();
+        addEntries(_root, 0, NO_PARENT);
+        Fentries.shrink_to_fit();
+        FpathHashes.shrink_to_fit();
+        buildPathTable();
+    }
+
+    size_t size() const { return Fentries.size(); }
+    const Tentry &operator[](size_t _id) const { return Fentries[_id]; }
+
+    /**
+     * @brief id of a descriptor (linear scan)
+     * @return NONE if not in the index
+     */
+    size_t idOf(Tdescr *_d) const
+    {
+        for (size_t i = 0; i < Fentries.size(); ++i)
+        {
+            if (Fentries[i].Fdescr == _d)
+                return i;
+        }
+        return NONE;
+    }
+
+    /**
+     * @brief id of the descriptor at a path (segments separated by '.')
+     * @return NONE if there is no such path in the index
+     */
+    size_t find(const char *_path) const
+    {
+        if (Fslots.empty())
+            return NONE;
+        size_t length = strlen(_path);
+        dtypes::uint64 hash = TstringHash::hash(_path, length);
+        for (size_t slot = hash & FslotsMask; Fslots[slot] != 0; slot = (slot + 1) & FslotsMask)
+        {
+            size_t id = Fslots[slot] - 1;
+            // full hash match plus the full path (guards against hash collisions of different paths)
+            if (FpathHashes[id] == hash && matchesPath(id, _path, length))
+                return id;
+        }
+        return NONE;
+    }
+
+    /**
+     * @brief the menu of a struct entry (nullptr if not a struct or empty)
+     */
+    TmenuHandle *menu(size_t _id) const
+    {
+        return Fentries[_id].isStruct() ? static_cast<Tstruct *>(Fentries[_id].Fdescr)->value() : nullptr;
+    }
+
+    /**
+     * @brief all entries
+     */
+    Trange all() const
+    {
+        return {0, Fentries.size()};
+    }
+
+    /**
+     * @brief all entries within the subtree of a struct entry
+     */
+    Trange subtree(size_t _id) const
+    {
+        return {_id + 1, Fentries[_id].Fend};
+    }
+
+    /**
+     * @brief all entries within a menu (the whole index for the root, empty if not in the index)
+     */
+    Trange subtree(TmenuHandle *_menu) const
+    {
+        if (_menu == Froot)
+            return all();
+        for (size_t i = 0; i < Fentries.size(); ++i)
+        {
+            if (menu(i) == _menu)
+                return subtree(i);
+        }
+        return {0, 0};
+    }
+};
@@ -0,0 +1,121 @@
+#pragma once
+#include "Particle.h"
+#include "uTypedef.h"
+
+/**
+ * @brief heap usage accounting per subsystem (current bytes, number of allocations and high-water mark)
+ * long-lived buffers report their allocations and releases, transient buffers (e.g. serialized
+ * structures) are measured by a scoped counter from the drop in free memory
+ * @note bytes are the payload sizes reported by the subsystems (or the measured heap drop), allocator
+ * overhead and fragmentation are not included
+ */
+class TheapAccount
+{
+
+public:
+    // accounted subsystems
+    enum Tsubsystem
+    {
+        SERIALIZER,  // serialized trees/values/state/logs (transient)
+        BURST,       // data of the current burst
+        QUEUE,       // queued and in-flight bursts
+        COMMAND_LOG, // command log
+        RESPONSE,    // variable response channels
+        N_SUBSYSTEMS
+    };
+
+    struct Taccount
+    {
+        dtypes::uint32 Fbytes = 0;     // currently allocated
+        dtypes::uint32 Fallocs = 0;    // number of allocations (total)
+        dtypes::uint32 FhighWater = 0; // max bytes
+    };
+
+    /**
+     * @brief measures the heap used by a transient buffer while the scope is alive
+     * call measure() while the buffer exists, the bytes are released when the scope ends
+     */
+    class Tscope
+    {
+    private:
+        TheapAccount &Faccount;
+        Tsubsystem Fsubsystem;
+        dtypes::uint32 FfreeStart;
+        dtypes::uint32 Fbytes = 0;
+
+    public:
+        Tscope(TheapAccount &_account, Tsubsystem _subsystem) : Faccount(_account), Fsubsystem(_subsystem), FfreeStart(System.freeMemory())
+        {
+        }
+        ~Tscope()
+        {
+            Faccount.released(Fsubsystem, Fbytes);
+        }
+        void measure()
+        {
+            dtypes::uint32 free = System.freeMemory();
+            if (free < FfreeStart && FfreeStart - free > Fbytes)
+            {
+                Faccount.allocated(Fsubsystem, FfreeStart - free - Fbytes);
+                Fbytes = FfreeStart - free;
+            }
+        }
+    };
+
+private:
+    inline static const char *const FsubsystemNames[N_SUBSYSTEMS] = {
+        "serializer", "burst", "queue", "commandLog", "response"};
+
+    Taccount Faccounts[N_SUBSYSTEMS];
+
+public:
+    // constructor
+    TheapAccount()
+    {
+    }
+
+    void allocated(Tsubsystem _subsystem, size_t _bytes)
+    {
+        Taccount &a = Faccounts[_subsystem];
+        a.Fbytes += _bytes;
+        a.Fallocs++;
+        if (a.Fbytes > a.FhighWater)
+            a.FhighWater = a.Fbytes;
+    }
+
+    void released(Tsubsystem _subsystem, size_t _bytes)
+    {
+        Taccount &a = Faccounts[_subsystem];
+        a.Fbytes = (a.Fbytes > _bytes) ? a.Fbytes - _bytes : 0;
+    }
+
+    /**
+     * @brief replace a buffer (release the old size, allocate the new one)
+     */
+    void reallocated(Tsubsystem _subsystem, size_t _oldBytes, size_t _newBytes)
+    {
+        released(_subsystem, _oldBytes);
+        if (_newBytes > 0)
+            allocated(_subsystem, _newBytes);
+    }
+
+    const Taccount &operator[](Tsubsystem _subsystem) const { return Faccounts[_subsystem]; }
+    static const char *name(Tsubsystem _subsystem) { return FsubsystemNames[_subsystem]; }
+
+    /**
+     * @brief summary of all subsystems: "name:bytes/allocs/highWater ..."
+     */
+    String toString() const
+    {
+        String summary;
+        for (int i = 0; i < N_SUBSYSTEMS; ++i)
+        {
+            const Taccount &a = Faccounts[i];
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%s%s:%lu/%lu/%lu", (summary.length() > 0) ? " " : "", FsubsystemNames[i],
+                     static_cast<unsigned long>(a.Fbytes), static_cast<unsigned long>(a.Fallocs), static_cast<unsigned long>(a.FhighWater));
+            summary += buf;
+        }
+        return summary;
+    }
+};
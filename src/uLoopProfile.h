@@ -0,0 +1,148 @@
+#pragma once
+#include "Particle.h"
+#include "uTypedef.h"
+#include <algorithm>
+
+/**
+ * @brief fixed table of run time statistics (count, total and max duration) for the library's own
+ * timers and callbacks plus the longest gap between hardware watchdog refreshes
+ * handlers are timed by placing a TloopProfile::Tscope on the stack at the start of the handler
+ * @note the times are exclusive: a handler that runs inside another one (e.g. a state save during the
+ * system check-in) is only counted for itself, so the totals of all handlers add up to the time spent
+ */
+class TloopProfile
+{
+
+public:
+    // profiled handlers
+    enum Thandler
+    {
+        BURST,           // data burst timer (burst serialization)
+        PUBLISH_QUEUE,   // publish check timer (event packing and sending)
+        PUBLISH_GLOBAL,  // global interval publish
+        VAR_SAMPLE,      // variable change callbacks (sampling)
+        VAR_PUBLISH,     // variable interval timers
+        COMMAND,         // sdds/sddsBatch/sddsCbor functions and command events
+        COMMAND_LOG,     // command log updates
+        PUBLISH_REQUEST, // tree/values/state publish requests
+        SYSTEM_CHECK,    // system check-in
+        SAVE_STATE,      // state saves
+        LOAD_STATE,      // state loads
+        FLASH_SCAN,      // flash usage scan steps
+        N_HANDLERS
+    };
+
+    struct Tstats
+    {
+        dtypes::uint32 Fcount = 0;
+        dtypes::uint64 Ftotal_us = 0;
+        dtypes::uint32 Fmax_us = 0;
+    };
+
+    /**
+     * @brief times the scope it lives in (minus the time of the scopes nested in it)
+     */
+    class Tscope
+    {
+    private:
+        TloopProfile &Fprofile;
+        Thandler Fhandler;
+        dtypes::uint32 Fstart;
+        Tscope *Fouter;
+        dtypes::uint32 Fnested_us = 0;
+
+    public:
+        Tscope(TloopProfile &_profile, Thandler _handler) : Fprofile(_profile), Fhandler(_handler), Fstart(micros()), Fouter(_profile.Factive)
+        {
+            Fprofile.Factive = this;
+        }
+        ~Tscope()
+        {
+            dtypes::uint32 duration = micros() - Fstart;
+            Fprofile.add(Fhandler, duration - std::min(Fnested_us, duration));
+            if (Fouter)
+                Fouter->Fnested_us += duration;
+            Fprofile.Factive = Fouter;
+        }
+    };
+
+private:
+    inline static const char *const FhandlerNames[N_HANDLERS] = {
+        "burst", "publishQueue", "publishGlobal", "varSample", "varPublish", "command",
+        "commandLog", "publishRequest", "systemCheck", "saveState", "loadState", "flashScan"};
+
+    Tstats Fstats[N_HANDLERS];
+    Tscope *Factive = nullptr; // innermost running scope
+    system_tick_t FlastWatchdogRefresh = 0;
+    system_tick_t FwatchdogGapMax_ms = 0;
+
+public:
+    // constructor
+    TloopProfile()
+    {
+    }
+
+    void add(Thandler _handler, dtypes::uint32 _duration_us)
+    {
+        Tstats &s = Fstats[_handler];
+        s.Fcount++;
+        s.Ftotal_us += _duration_us;
+        if (_duration_us > s.Fmax_us)
+            s.Fmax_us = _duration_us;
+    }
+
+    /**
+     * @brief call whenever the hardware watchdog is refreshed
+     */
+    void watchdogRefreshed()
+    {
+        system_tick_t now = millis();
+        if (FlastWatchdogRefresh > 0 && now - FlastWatchdogRefresh > FwatchdogGapMax_ms)
+            FwatchdogGapMax_ms = now - FlastWatchdogRefresh;
+        FlastWatchdogRefresh = now;
+    }
+
+    system_tick_t watchdogGapMax() const { return FwatchdogGapMax_ms; }
+    const Tstats &operator[](Thandler _handler) const { return Fstats[_handler]; }
+    static const char *name(Thandler _handler) { return FhandlerNames[_handler]; }
+
+    /**
+     * @brief the handler with the longest single run
+     */
+    Thandler slowest() const
+    {
+        int slowest = 0;
+        for (int i = 1; i < N_HANDLERS; ++i)
+        {
+            if (Fstats[i].Fmax_us > Fstats[slowest].Fmax_us)
+                slowest = i;
+        }
+        return static_cast<Thandler>(slowest);
+    }
+
+    void reset()
+    {
+        for (Tstats &s : Fstats)
+            s = Tstats();
+        FwatchdogGapMax_ms = 0;
+    }
+
+    /**
+     * @brief compact summary of all handlers that ran: "name:count/total_ms/max_us ..."
+     */
+    String toString() const
+    {
+        String summary;
+        for (int i = 0; i < N_HANDLERS; ++i)
+        {
+            const Tstats &s = Fstats[i];
+            if (s.Fcount == 0)
+                continue;
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%s%s:%lu/%lu/%lu", (summary.length() > 0) ? " " : "", FhandlerNames[i],
+                     static_cast<unsigned long>(s.Fcount), static_cast<unsigned long>(s.Ftotal_us / 1000), static_cast<unsigned long>(s.Fmax_us));
+            summary += buf;
+        }
+        return summary;
+    }
+};
@@ -0,0 +1,275 @@
+#pragma once
+#include "Particle.h"
+#include "uTypedef.h"
+#include "uRunningStats.h"
+#include <new>
+
+/**
+ * @brief fixed capacity ring buffer, once full the oldest entries are overwritten
+ */
+template <typename T>
+class TringBuffer
+{
+
+private:
+    T *Fdata = nullptr;
+    size_t Fcapacity = 0;
+    size_t Fstart = 0;  // index of the oldest entry
+    size_t Fsize = 0;   // number of entries
+    size_t Fpushed = 0; // number of entries ever pushed (not reset by clear)
+
+public:
+    // constructor
+    TringBuffer()
+    {
+    }
+    ~TringBuffer()
+    {
+        delete[] Fdata;
+    }
+    TringBuffer(const TringBuffer &) = delete;
+    TringBuffer &operator=(const TringBuffer &) = delete;
+
+    /**
+     * @brief (re)allocate the buffer (clears all entries)
+     * @return whether the memory could be allocated
+     */
+    bool allocate(size_t _capacity)
+    {
+        delete[] Fdata;
+        Fdata = (_capacity > 0) ? new (std::nothrow) T[_capacity] : nullptr;
+        Fcapacity = (Fdata) ? _capacity : 0;
+        clear();
+        return (Fcapacity == _capacity);
+    }
+
+    /**
+     * @brief add an entry (overwrites the oldest one if the buffer is full)
+     */
+    void push(const T &_item)
+    {
+        if (Fcapacity == 0)
+            return;
+        Fpushed++;
+        if (Fsize < Fcapacity)
+        {
+            Fdata[(Fstart + Fsize) % Fcapacity] = _item;
+            Fsize++;
+        }
+        else
+        {
+            Fdata[Fstart] = _item;
+            Fstart = (Fstart + 1) % Fcapacity;
+        }
+    }
+
+    /**
+     * @brief entry access, 0 is the oldest entry
+     */
+    const T &at(size_t _i) const
+    {
+        return Fdata[(Fstart + _i) % Fcapacity];
+    }
+
+    size_t size() const
+    {
+        return Fsize;
+    }
+
+    /**
+     * @brief absolute position of the i-th entry (stays the same when older entries are overwritten)
+     */
+    size_t position(size_t _i) const
+    {
+        return Fpushed - Fsize + _i;
+    }
+
+    /**
+     * @brief position after the newest entry
+     */
+    size_t endPosition() const
+    {
+        return Fpushed;
+    }
+
+    /**
+     * @brief entry access by absolute position
+     * @return nullptr if the entry was overwritten (or cleared) in the meantime
+     */
+    const T *atPosition(size_t _pos) const
+    {
+        if (_pos < Fpushed - Fsize || _pos >= Fpushed)
+            return nullptr;
+        return &at(_pos - (Fpushed - Fsize));
+    }
+
+    size_t capacity() const
+    {
+        return Fcapacity;
+    }
+
+    void clear()
+    {
+        Fstart = 0;
+        Fsize = 0;
+    }
+};
+
+/**
+ * @brief single raw value in the history
+ */
+struct ThistorySample
+{
+    time32_t Ftime;         // unix time in seconds
+    dtypes::float32 Fvalue; // value
+};
+
+/**
+ * @brief aggregated values in the history
+ */
+struct ThistoryAggregate
+{
+    time32_t Ftime = 0;  // unix time in seconds of the start of the aggregation period (0 = none)
+    TrunningStats Fstats; // stats of all values in the aggregation period
+};
+
+/**
+ * @brief how much history to keep (number of entries in each tier)
+ * @note a raw value takes 8 bytes, an aggregate 40 bytes, i.e. the defaults take ~15 kB
+ * (P2/M-SoM) or ~4 kB (other platforms) of RAM per variable
+ */
+struct ThistoryConfig
+{
+#if (PLATFORM_ID == PLATFORM_P2 || PLATFORM_ID == PLATFORM_MSOM)
+    size_t Fraw = 120;         // last 120 raw values
+    size_t Fminutes = 3 * 60;  // 1-minute aggregates for 3 hours
+    size_t Fhours = 7 * 24;    // 1-hour aggregates for 7 days
+#else
+    size_t Fraw = 60;          // last 60 raw values
+    size_t Fminutes = 60;      // 1-minute aggregates for 1 hour
+    size_t Fhours = 24;        // 1-hour aggregates for 1 day
+#endif
+    ThistoryConfig() {}
+    ThistoryConfig(size_t _raw, size_t _minutes, size_t _hours) : Fraw(_raw), Fminutes(_minutes), Fhours(_hours) {}
+};
+
+/**
+ * @brief multi-resolution history of a numeric variable: raw values plus 1-minute
+ * and 1-hour aggregates, the hour aggregates are built by merging completed minutes
+ */
+class TvarHistory
+{
+
+public:
+    // resolution of the history tiers (in seconds)
+    enum Tresolution
+    {
+        RAW = 0,
+        MINUTES = 60,
+        HOURS = 60 * 60
+    };
+
+private:
+    TringBuffer<ThistorySample> Fraw;
+    TringBuffer<ThistoryAggregate> Fminutes;
+    TringBuffer<ThistoryAggregate> Fhours;
+    ThistoryAggregate FcurrentMinute;
+    ThistoryAggregate FcurrentHour;
+
+    /**
+     * @brief move the current minute into the minute tier and merge it into the current hour
+     */
+    void completeMinute()
+    {
+        if (FcurrentMinute.Ftime == 0)
+            return;
+        Fminutes.push(FcurrentMinute);
+        FcurrentHour.Fstats.merge(FcurrentMinute.Fstats);
+        FcurrentMinute = ThistoryAggregate();
+    }
+
+    /**
+     * @brief start a new minute (and a new hour if the minute is in the next hour)
+     */
+    void startMinute(time32_t _minute)
+    {
+        time32_t hour = _minute - _minute % HOURS;
+        if (FcurrentHour.Ftime != hour)
+        {
+            if (FcurrentHour.Ftime != 0)
+                Fhours.push(FcurrentHour);
+            FcurrentHour = ThistoryAggregate();
+            FcurrentHour.Ftime = hour;
+        }
+        FcurrentMinute.Ftime = _minute;
+    }
+
+public:
+    // constructor
+    TvarHistory()
+    {
+    }
+
+    /**
+     * @brief allocate the history tiers
+     * @return whether all tiers could be allocated
+     */
+    bool setup(const ThistoryConfig &_config)
+    {
+        FcurrentMinute = ThistoryAggregate();
+        FcurrentHour = ThistoryAggregate();
+        bool ok = Fraw.allocate(_config.Fraw);
+        ok = Fminutes.allocate(_config.Fminutes) && ok;
+        ok = Fhours.allocate(_config.Fhours) && ok;
+        return ok;
+    }
+
+    /**
+     * @brief add a value to the history
+     * @param _time unix time in seconds
+     */
+    void add(time32_t _time, dtypes::float64 _value)
+    {
+        Fraw.push({_time, static_cast<dtypes::float32>(_value)});
+        time32_t minute = _time - _time % MINUTES;
+        if (FcurrentMinute.Ftime != minute)
+        {
+            completeMinute();
+            startMinute(minute);
+        }
+        FcurrentMinute.Fstats.add(_value);
+    }
+
+    /**
+     * @brief finest resolution that covers everything since _from (or the coarsest one that has any data)
+     */
+    Tresolution resolutionFor(time32_t _from)
+    {
+        if (Fraw.size() > 0 && Fraw.at(0).Ftime <= _from)
+            return RAW;
+        time32_t oldestMinute = (Fminutes.size() > 0) ? Fminutes.at(0).Ftime : FcurrentMinute.Ftime;
+        if (oldestMinute > 0 && oldestMinute <= _from)
+            return MINUTES;
+        if (Fhours.size() > 0 || FcurrentHour.Ftime > 0)
+            return HOURS;
+        if (oldestMinute > 0)
+            return MINUTES;
+        return RAW;
+    }
+
+    // tier access
+    const TringBuffer<ThistorySample> &raw() { return Fraw; }
+    const TringBuffer<ThistoryAggregate> &aggregates(Tresolution _res) { return (_res == HOURS) ? Fhours : Fminutes; }
+
+    /**
+     * @brief the currently open aggregation period (includes the current minute if it's the hour tier)
+     */
+    ThistoryAggregate current(Tresolution _res)
+    {
+        if (_res != HOURS)
+            return FcurrentMinute;
+        ThistoryAggregate hour = FcurrentHour;
+        hour.Fstats.merge(FcurrentMinute.Fstats);
+        return hour;
+    }
+};
@@ -6,6 +6,24 @@
 #include "uPlainCommHandler.h"
 #include "uParticleSystem.h"
 #include "uRunningStats.h"
+#include "uStringHash.h"
+#include "uParticleHistory.h"
+#include "uDescrIndex.h"
+#include "uPathPattern.h"
+#include "uCommandBatch.h"
+#include <algorithm>
+#include <functional>
+
+// variable response channels (can be defined before including to change the defaults)
+#ifndef SDDS_PARTICLE_RESPONSE_CHANNELS
+#define SDDS_PARTICLE_RESPONSE_CHANNELS 4 // number of getSddsCh helper variables
+#endif
+#ifndef SDDS_PARTICLE_RESPONSE_SIZE
+#define SDDS_PARTICLE_RESPONSE_SIZE particle::protocol::MAX_VARIABLE_VALUE_LENGTH // chars per transmission
+#endif
+#ifndef SDDS_PARTICLE_RESPONSE_TTL_MS
+#define SDDS_PARTICLE_RESPONSE_TTL_MS 60000 // channels not read for this long are released
+#endif
 
 // particle spike class
 class TparticleSpike
@@ -101,6 +119,29 @@ private:
 		inline static const char *FvarLogTimeBaseKey = "tb";
 		inline static const char *FvarLogCmdsLogKey = "l";
 
+		// keys for variable history
+		inline static const char *FhistDeviceNameKey = "n";
+		inline static const char *FhistVarKey = "v";
+		inline static const char *FhistTimeBaseKey = "tb";
+		inline static const char *FhistResolutionKey = "r";
+		inline static const char *FhistDataKey = "h";
+
+		// keys for command event acknowledgements
+		inline static const char *FackDeviceNameKey = "n";
+		inline static const char *FackIdKey = "a";
+		inline static const char *FackResultKey = "r";
+
+		// keys for crash reports
+		inline static const char *FcrashDeviceNameKey = "n";
+		inline static const char *FcrashRestartKey = "x";
+		inline static const char *FcrashUptimeKey = "u";
+		inline static const char *FcrashFreeRamKey = "f";
+		inline static const char *FcrashMonitorMaxKey = "m";
+		inline static const char *FcrashWatchdogGapKey = "w";
+		inline static const char *FcrashQueuedKey = "q";
+		inline static const char *FcrashMemoryStageKey = "s";
+		inline static const char *FcrashRecoveredKey = "b";
+
 		// base64 charset
 		inline static const char base64_chars[] =
 			"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
@@ -110,81 +151,82 @@ private:
 		/**
 		 * @brief serialize structure enumerations
 		 */
-		static Variant serializeEnums(TmenuHandle *_struct)
+		static Variant serializeEnums(const TdescrIndex &_index, TdescrIndex::Trange _range)
 		{
-			Vector<sdds::metaTypes::TenumId> enumIds;
+			Vector<sdds::metaTypes::TenumId> ids;
 			Variant enums;
-			serializeEnums(_struct, enums, enumIds);
-			return (enums);
-		}
-
-		static void serializeEnums(TmenuHandle *_struct, Variant &_enums, Vector<sdds::metaTypes::TenumId> &_ids)
-		{
-			for (auto it = _struct->iterator(); it.hasCurrent(); it.jumpToNext())
+			for (size_t i = _range.Ffirst; i < _range.Fend; ++i)
 			{
-				Tdescr *d = it.current();
-				if (d->isStruct())
-				{
-					// recursively serialize sub-structs
-					TmenuHandle *mh = static_cast<Tstruct *>(d)->value();
-					if (mh)
-						serializeEnums(mh, _enums, _ids);
-				}
-				else if (d->type() == sdds::Ttype::ENUM)
+				if (_index[i].Ftype != sdds::Ttype::ENUM)
+					continue;
+
+				// check if this enumeration has already been serialized
+				TenumBase *en = static_cast<TenumBase *>(_index[i].Fdescr);
+				sdds::metaTypes::TenumId uid = en->enumInfo().id;
+				bool alreadySerialized = false;
+				for (size_t j = 0; j < ids.size(); ++j)
 				{
-					// check if this enumeration has already been serialized
-					TenumBase *en = static_cast<TenumBase *>(d);
-					sdds::metaTypes::TenumId uid = en->enumInfo().id;
-					bool alreadySerialized = false;
-					for (size_t i = 0; i < _ids.size(); ++i)
-					{
-						if (uid == _ids[i])
-						{
-							alreadySerialized = true;
-							break;
-						}
-					}
-					if (alreadySerialized)
-						continue;
-
-					// new enum --> remember and serialize
-					_ids.append(uid);
-					Variant enumeration;
-					enumeration.append(uid);
-					Variant values;
-					for (auto it = en->enumInfo().iterator;;)
+					if (uid == ids[j])
 					{
-						values.append(it.next());
-						if (!it.hasNext())
-							break;
+						alreadySerialized = true;
+						break;
 					}
-					enumeration.append(values);
-					_enums.append(enumeration);
 				}
+				if (alreadySerialized)
+					continue;
+
+				// new enum --> remember and serialize
+				ids.append(uid);
+				Variant enumeration;
+				enumeration.append(uid);
+				Variant values;
+				for (auto it = en->enumInfo().iterator;;)
+				{
+					values.append(it.next());
+					if (!it.hasNext())
+						break;
+				}
+				enumeration.append(values);
+				enums.append(enumeration);
 			}
+			return (enums);
 		}
 
 		/**
 		 * @brief serialize structure
+		 * @note single pass over the index, open structs are kept on a stack until their subtree ends
 		 */
-		static Variant serializeStruct(TmenuHandle *_struct, bool _withKeys = true)
+		static Variant serializeStruct(const TdescrIndex &_index, TdescrIndex::Trange _range, bool _withKeys = true)
 		{
+			struct Tframe
+			{
+				Variant Fitem;
+				Variant Fsub;
+				size_t Fend;
+			};
+			std::vector<Tframe> open;
 			Variant var;
-			auto it = _struct->iterator();
-			for (auto it = _struct->iterator(); it.hasCurrent(); it.jumpToNext())
+			auto closeStruct = [&]()
 			{
-				Tdescr *d = it.current();
-				Variant item = serializeDescr(d, _withKeys);
-				if (d->isStruct())
-				{
-					TmenuHandle *mh = static_cast<Tstruct *>(d)->value();
-					Variant sub;
-					if (mh)
-						sub = serializeStruct(mh, _withKeys);
-					(_withKeys) ? item.set(FdescSubStructKey, sub) : item.append(sub);
-				}
-				var.append(item);
+				Tframe &f = open.back();
+				(_withKeys) ? f.Fitem.set(FdescSubStructKey, f.Fsub) : f.Fitem.append(f.Fsub);
+				Variant item = f.Fitem;
+				open.pop_back();
+				(open.empty() ? var : open.back().Fsub).append(item);
+			};
+			for (size_t i = _range.Ffirst; i < _range.Fend; ++i)
+			{
+				while (!open.empty() && open.back().Fend <= i)
+					closeStruct();
+				const TdescrIndex::Tentry &e = _index[i];
+				Variant item = serializeDescr(e.Fdescr, _withKeys);
+				if (e.isStruct())
+					open.push_back({item, Variant(), e.Fend});
+				else
+					(open.empty() ? var : open.back().Fsub).append(item);
 			}
+			while (!open.empty())
+				closeStruct();
 			return var;
 		}
 
@@ -301,20 +343,20 @@ private:
 		 * @brief serialize tree as variant
 		 * @param _withKeys whether to include the identifier keys or use unnamed entries
 		 */
-		static Variant serializeTree(TmenuHandle *_struct, bool _withKeys = true)
+		static Variant serializeTree(const TdescrIndex &_index, TdescrIndex::Trange _range, bool _withKeys = true)
 		{
 			Variant var;
-			var.set(FtreeEnumKey, serializeEnums(_struct));
-			var.set(FtreeStructKey, serializeStruct(_struct, _withKeys));
+			var.set(FtreeEnumKey, serializeEnums(_index, _range));
+			var.set(FtreeStructKey, serializeStruct(_index, _range, _withKeys));
 			return (var);
 		}
 
 		/**
 		 * @brief serialize with particle information added
 		 */
-		static Variant serializeParticleTree(TmenuHandle *_struct)
+		static Variant serializeParticleTree(const TdescrIndex &_index)
 		{
-			Variant var = serializeTree(_struct, false);
+			Variant var = serializeTree(_index, _index.all(), false);
 			var.set(FtreeTypeKey, particleSystem().type.c_str());
 			var.set(FtreeVersionKey, particleSystem().version.value());
 			var.set(FtreeDeviceNameKey, particleSystem().name.c_str());
@@ -327,60 +369,86 @@ private:
 		 * @param _optsFilter whether to filter for values with speicifc options
 		 * @param _enumAsText whether to include enum values as text (instead of number)
 		 * @param _exclude a menu item to exclude from the serialization if encoutnered
+		 * @note single pass over the index, open structs are kept on a stack until their subtree ends
 		 */
-		static Variant serializeValues(TmenuHandle *_struct, bool _withNameAsKey = true, int _optsFilter = -1, bool _enumAsText = true, TmenuHandle *_exclude = nullptr)
+		static Variant serializeValues(const TdescrIndex &_index, TdescrIndex::Trange _range, bool _withNameAsKey = true, int _optsFilter = -1, bool _enumAsText = true, TmenuHandle *_exclude = nullptr)
 		{
+			struct Tframe
+			{
+				const char *Fname;
+				Variant Fvalues;
+				size_t Fend;
+			};
+			std::vector<Tframe> open;
 			Variant var;
-			for (auto it = _struct->iterator(); it.hasCurrent(); it.jumpToNext())
+			auto add = [&](const char *_name, const Variant &_item)
+			{
+				Variant &target = open.empty() ? var : open.back().Fvalues;
+				if (_withNameAsKey)
+					target.set(_name, _item);
+				else
+					target.append(_item);
+			};
+			auto closeStruct = [&]()
+			{
+				Tframe f = open.back();
+				open.pop_back();
+				add(f.Fname, f.Fvalues);
+			};
+			for (size_t i = _range.Ffirst; i < _range.Fend; ++i)
 			{
-				Variant item; // default: NULL
-				Tdescr *d = it.current();
-				if (d->isStruct())
+				while (!open.empty() && open.back().Fend <= i)
+					closeStruct();
+				const TdescrIndex::Tentry &e = _index[i];
+				if (e.isStruct())
 				{
-					TmenuHandle *mh = static_cast<Tstruct *>(d)->value();
-					if (mh && (!_exclude || mh != _exclude))
-						item = serializeValues(mh, _withNameAsKey, _optsFilter, _enumAsText, _exclude);
+					if (_exclude && _index.menu(i) == _exclude)
+					{
+						// skip the whole subtree
+						add(e.Fdescr->name(), Variant());
+						i = e.Fend - 1;
+					}
+					else
+						open.push_back({e.Fdescr->name(), Variant(), e.Fend});
 				}
 				else
 				{
 					if (_optsFilter >= 0)
 					{
 						// opts filter is active, check if d has the requested option(s)
-						if ((d->meta().option & _optsFilter) != _optsFilter)
+						if ((e.Foption & _optsFilter) != _optsFilter)
 							continue;
 					}
-					item = serializeValue(d, _enumAsText);
+					add(e.Fdescr->name(), serializeValue(e.Fdescr, _enumAsText));
 				}
-				if (_withNameAsKey)
-					var.set(d->name(), item);
-				else
-					var.append(item);
 			}
+			while (!open.empty())
+				closeStruct();
 			return var;
 		}
 
 		/**
 		 * @brief serialize with particle information added
 		 */
-		static Variant serializeParticleValues(TmenuHandle *_struct)
+		static Variant serializeParticleValues(const TdescrIndex &_index)
 		{
 			Variant var;
 			var.set(FvaluesTypeKey, particleSystem().type.c_str());
 			var.set(FvaluesVersionKey, particleSystem().version.value());
 			var.set(FvaluesDeviceNameKey, particleSystem().name.c_str());
-			var.set(FvaluesDataKey, serializeValues(_struct, false, -1, false));
+			var.set(FvaluesDataKey, serializeValues(_index, _index.all(), false, -1, false));
 			return var;
 		}
 
 		/**
 		 * @brief serialize state variable/value pairs (i.e. all elemens that can be stored in EEPROM)
 		 */
-		static Variant serializeParticleState(TmenuHandle *_struct)
+		static Variant serializeParticleState(const TdescrIndex &_index)
 		{
 			Variant var;
 			var.set(FstateDeviceNameKey, particleSystem().name.c_str());
 			var.set(FstateTimeBaseKey, Time.format(Time.now(), TIME_FORMAT_ISO8601_FULL));
-			var.set(FstateDataKey, serializeValues(_struct, true, sdds::opt::saveval, true));
+			var.set(FstateDataKey, serializeValues(_index, _index.all(), true, sdds::opt::saveval, true));
 			return var;
 		}
 
@@ -482,71 +550,139 @@ private:
 		}
 
 		/**
-		 * @brief serialize a command with it's return code and message
+		 * @brief serialize a command with it's return code
 		 * @todo do we need a version with keys here? probably fine as array
 		 */
-		static Variant serializeCommand(system_tick_t _time, const String &_cmd, int _code, const char *_msg)
+		static Variant serializeCommand(system_tick_t _time, const String &_cmd, int _code)
 		{
 			Variant var;
 			var.append(_time);
 			var.append(_cmd);
 			var.append(_code);
-			// var.append(_msg);
 			return (var);
 		}
 
 		/**
 		 * @brief serialize command log
 		 * @param _refTime the time base of all the commands in the provided log
-		 * @param _timeShift how much to shift ("time rebase") the logs in addition
 		 */
-		static Variant serializeCommandLog(system_tick_t _refTime, system_tick_t _timeShift, const Variant &_log)
+		static Variant serializeCommandLog(system_tick_t _refTime, const Variant &_log)
 		{
-			// rebase the logs
-			Variant rebasedLog;
-			if (_log.isArray())
-			{
-				for (size_t i = 0; i < _log.size(); ++i)
-				{
-					Variant entry = _log.at(i);
-					if (_timeShift > 0 && entry.isArray() && !entry.isEmpty())
-					{
-						// shift time
-						system_tick_t offset = entry[0].toUInt();
-						entry.removeAt(0);
-						if (offset > _timeShift)
-							entry.prepend(offset - _timeShift);
-						else
-							entry.prepend(0);
-					}
-					rebasedLog.append(entry);
-				}
-			}
-
 			// whole log
 			Variant var;
 
 			// time base (if valid time, otherwise NULL)
 			if (Time.isValid())
 			{
-				time_t timeBase = Time.now() - static_cast<time_t>(round(static_cast<dtypes::float64>(millis() - _refTime - _timeShift) / 1000));
+				time_t timeBase = Time.now() - static_cast<time_t>(round(static_cast<dtypes::float64>(millis() - _refTime) / 1000));
 				var.set(FvarLogTimeBaseKey, Time.format(timeBase, TIME_FORMAT_ISO8601_FULL));
 			}
 			else
 			{
 				var.set(FvarLogTimeBaseKey, Variant());
 			}
-			var.set(FvarLogCmdsLogKey, rebasedLog);
+			var.set(FvarLogCmdsLogKey, _log);
 			return (var);
 		}
 
+		// longest history entries as written below, e.g. "-1.234568e+308" is the longest number (14 chars)
+		constexpr static size_t HISTORY_SAMPLE_MAX = 1 + 11 + 1 + 14 + 1;					  // [offset,value]
+		constexpr static size_t HISTORY_AGGREGATE_MAX = 1 + 11 + 1 + 14 + 1 + 10 + 1 + 14 + 1; // [offset,mean,n,sdev]
+
+		/**
+		 * @brief history number as JSON (7 significant digits, null if not finite)
+		 */
+		static int formatHistoryNumber(char *_buf, size_t _size, dtypes::float64 _value)
+		{
+			return (std::isfinite(_value)) ? snprintf(_buf, _size, "%.7g", _value) : snprintf(_buf, _size, "null");
+		}
+
+		/**
+		 * @brief serialize a single history aggregate (at most HISTORY_AGGREGATE_MAX chars)
+		 * @param _timeBase the time (in seconds) to normalize against
+		 */
+		static void serializeHistoryAggregate(String &_dest, time32_t _timeBase, const ThistoryAggregate &_agg)
+		{
+			TrunningStats stats = _agg.Fstats;
+			char entry[HISTORY_AGGREGATE_MAX + 1];
+			int len = snprintf(entry, sizeof(entry), "[%ld,", static_cast<long>(_agg.Ftime - _timeBase));
+			len += formatHistoryNumber(entry + len, sizeof(entry) - len, stats.mean());
+			len += snprintf(entry + len, sizeof(entry) - len, ",%lu", static_cast<unsigned long>(stats.count()));
+			if (stats.count() > 1)
+			{
+				len += snprintf(entry + len, sizeof(entry) - len, ",");
+				len += formatHistoryNumber(entry + len, sizeof(entry) - len, stats.stdDev());
+			}
+			snprintf(entry + len, sizeof(entry) - len, "]");
+			_dest.concat(entry);
+		}
+
+		/**
+		 * @brief serialize a single raw history value (at most HISTORY_SAMPLE_MAX chars)
+		 * @param _timeBase the time (in seconds) to normalize against
+		 */
+		static void serializeHistorySample(String &_dest, time32_t _timeBase, const ThistorySample &_sample)
+		{
+			char entry[HISTORY_SAMPLE_MAX + 1];
+			int len = snprintf(entry, sizeof(entry), "[%ld,", static_cast<long>(_sample.Ftime - _timeBase));
+			len += formatHistoryNumber(entry + len, sizeof(entry) - len, _sample.Fvalue);
+			snprintf(entry + len, sizeof(entry) - len, "]");
+			_dest.concat(entry);
+		}
+
+		/**
+		 * @brief serialize the JSON around the history data of a variable, i.e. everything before
+		 * (_prefix) and after (_suffix) the entries of the data array, so the entries can be
+		 * generated one at a time (see ThistoryResponse)
+		 */
+		static void serializeHistoryFrame(Tdescr *_d, TvarHistory::Tresolution _res, time32_t _timeBase, String &_prefix, String &_suffix)
+		{
+			Variant var;
+			var.set(FhistDeviceNameKey, particleSystem().name.c_str());
+			var.set(FhistVarKey, getVarPath(_d));
+			var.set(FhistTimeBaseKey, (_timeBase > 0) ? Variant(Time.format(_timeBase, TIME_FORMAT_ISO8601_FULL)) : Variant());
+			var.set(FhistResolutionKey, static_cast<int>(_res));
+			var.set(FhistDataKey, Variant(VariantArray()));
+			String json = var.toJSON();
+			// split at the (empty) data array
+			String data = String("\"") + FhistDataKey + "\":[";
+			int split = json.indexOf(data);
+			split = (split < 0) ? json.length() : split + data.length();
+			_prefix = json.substring(0, split);
+			_suffix = json.substring(split);
+		}
+
 		/**
-		 * @brief get logs back out of string
+		 * @brief serialize the acknowledgement of a command event batch
 		 */
-		static Variant deserializeCommandLog(const char *_logString)
+		static Variant serializeCommandAck(const String &_id, int _result)
 		{
-			return Variant::fromJSON(_logString).get(FvarLogCmdsLogKey);
+			Variant var;
+			var.set(FackDeviceNameKey, particleSystem().name.c_str());
+			var.set(FackIdKey, _id);
+			var.set(FackResultKey, _result);
+			return var;
+		}
+
+#ifdef SDDS_PARTICLE_CRASH_RING
+		/**
+		 * @brief serialize the counters recovered after a crash
+		 */
+		static Variant serializeCrashReport(const TcrashRing::Tcounters &_counters, size_t _recovered)
+		{
+			Variant var;
+			var.set(FcrashDeviceNameKey, particleSystem().name.c_str());
+			var.set(FcrashRestartKey, particleSystem().vitals.lastRestart.to_string().c_str());
+			var.set(FcrashUptimeKey, _counters.Fuptime_s);
+			var.set(FcrashFreeRamKey, _counters.FfreeRAM_byte);
+			var.set(FcrashMonitorMaxKey, _counters.FmonitorMax_us);
+			var.set(FcrashWatchdogGapKey, _counters.FwatchdogGapMax_ms);
+			var.set(FcrashQueuedKey, _counters.Fqueued);
+			var.set(FcrashMemoryStageKey, _counters.FmemoryStage);
+			var.set(FcrashRecoveredKey, static_cast<unsigned>(_recovered));
+			return var;
 		}
+#endif
 
 		/**
 		 * @brief get the path of the descriptor variable
@@ -628,6 +764,48 @@ private:
 			return encoded;
 		}
 
+		/**
+		 * @brief decode base 64 encoded binary data (counterpart of encodeBinaryInBase64)
+		 * @param _data the decoded data
+		 * @return whether _encoded was valid base64 (padding is optional)
+		 */
+		static bool decodeBinaryFromBase64(const String &_encoded, String &_data)
+		{
+			std::vector<char> decoded;
+			decoded.reserve(_encoded.length() * 3 / 4);
+			int val = 0, valb = -8;
+			for (size_t i = 0; i < _encoded.length(); ++i)
+			{
+				if (_encoded[i] == '=')
+					break; // padding
+				int c = decodeIntFromBase64(_encoded[i]);
+				if (c < 0)
+					return false;
+				val = ((val << 6) + c) & 0xFFF; // at most 12 bits are pending
+				valb += 6;
+				if (valb >= 0)
+				{
+					decoded.push_back(static_cast<char>((val >> valb) & 0xFF));
+					valb -= 8;
+				}
+			}
+			_data = String(decoded.data(), decoded.size());
+			return true;
+		}
+
+		/**
+		 * @brief convert base64 encoded CBOR back to a variant
+		 * @return whether _encoded could be decoded
+		 */
+		static bool base64ToVariant(const String &_encoded, Variant &_var)
+		{
+			String cbor;
+			if (!decodeBinaryFromBase64(_encoded, cbor))
+				return false;
+			InputStringStream stream(cbor);
+			return (decodeFromCBOR(_var, stream) == 0);
+		}
+
 		/**
 		 * @brief integer serializer for values up from 0 to 63
 		 * returns '>' if value is too large
@@ -664,40 +842,152 @@ private:
 /*** particle variable response channels ***/
 #pragma region response channels
 
+	/**
+	 * @brief response that is generated piece by piece while its channel is read
+	 * (for responses that are too large to keep in memory as a whole)
+	 */
+	class TparticleResponseSource
+	{
+	public:
+		virtual ~TparticleResponseSource() {}
+
+		/**
+		 * @brief total length of the response (the generated pieces are padded/truncated to exactly this)
+		 */
+		virtual size_t length() = 0;
+
+		/**
+		 * @brief append the next piece of the response to _dest
+		 * @return false if there is nothing left
+		 */
+		virtual bool next(String &_dest) = 0;
+	};
+
+	/**
+	 * @brief pool of channels for responses that don't fit into a single particle variable
+	 * @tparam tChannels number of channels (getSddsCh helper variables)
+	 * @tparam tResponseSize max chars per transmission (at most the OS' variable value length)
+	 * @tparam tTtl_ms channels that were not read for this long are released (0 = never)
+	 */
+	template <size_t tChannels, size_t tResponseSize, system_tick_t tTtl_ms>
 	class TparticleVariableResponse
 	{
 
 	public:
-		const static size_t RESPONSE_SIZE = 400;		   // FIXME particle::protocol::MAX_VARIABLE_VALUE_LENGTH;
+		const static size_t RESPONSE_SIZE = tResponseSize;
 		const static size_t DATA_SIZE = RESPONSE_SIZE - 1; // leave 1 char space for adding number of transmissions remaining (in base 64)
 		const static size_t INITIAL_SIZE = DATA_SIZE - 1;  // leave an additional 1 char space for indicating the channel the data is stored in
-		const static size_t N_CHANNELS = 4;				   // how many channels are available?
+		const static size_t N_CHANNELS = tChannels;		   // how many channels are available?
+		const static system_tick_t TTL_MS = tTtl_ms;
+
+		// channel IDs and remaining transmissions are single base64 chars
+		static_assert(tChannels > 0 && tChannels <= 64, "response channels must be between 1 and 64");
+		static_assert(tResponseSize > 2 && tResponseSize <= particle::protocol::MAX_VARIABLE_VALUE_LENGTH,
+					  "response size must fit into a particle variable");
+
+		/**
+		 * @brief append _length characters of _src starting at _start to _dest without a heap copy of the slice
+		 * (_src is not changed, a slice that doesn't reach its end is copied through a small stack buffer)
+		 */
+		static void appendSlice(String &_dest, const String &_src, size_t _start, size_t _length)
+		{
+			if (_start >= _src.length())
+				return;
+			size_t end = std::min<size_t>(_start + _length, _src.length());
+			if (end == _src.length())
+			{
+				_dest.concat(_src.c_str() + _start);
+				return;
+			}
+			char piece[65];
+			for (size_t pos = _start; pos < end;)
+			{
+				size_t n = std::min<size_t>(end - pos, sizeof(piece) - 1);
+				memcpy(piece, _src.c_str() + pos, n);
+				piece[n] = '\0';
+				_dest.concat(piece);
+				pos += n;
+			}
+		}
+
+		/**
+		 * @brief generate pieces of _source into _dest until it is _target long or _pending runs out
+		 * (a source that ends early is padded with spaces, one that generates too much is truncated)
+		 */
+		static void generate(TparticleResponseSource *_source, String &_dest, size_t _target, size_t &_pending)
+		{
+			while (_dest.length() < _target && _pending > 0)
+			{
+				size_t before = _dest.length();
+				if (!_source->next(_dest))
+				{
+					for (; _pending > 0; _pending--)
+						_dest.concat(' ');
+					break;
+				}
+				size_t added = _dest.length() - before;
+				if (added > _pending)
+				{
+					_dest.remove(before + _pending);
+					added = _pending;
+				}
+				_pending -= added;
+			}
+		}
 
 		// channel class
 		class Tchannel
 		{
 
-			String Fresponse = "";
+			String Fresponse = ""; // complete response (the part before FbytesStart was already sent)
 			size_t Fchannel = 0;
 			size_t FbytesStart = 0;
 			system_tick_t FlastUsed = 0;
 
+			// generated responses: the source and how many of its bytes are not in Fresponse yet
+			TparticleResponseSource *Fsource = nullptr;
+			size_t FsourcePending = 0;
+
+			/**
+			 * @brief make sure at least _bytes unsent bytes are in Fresponse (if there are that many)
+			 * the part that was already sent is dropped first
+			 */
+			void fill(size_t _bytes)
+			{
+				if (!Fsource || Fresponse.length() - FbytesStart >= _bytes)
+					return;
+				size_t before = Fresponse.length();
+				if (FbytesStart > 0)
+				{
+					Fresponse.remove(0, FbytesStart);
+					FbytesStart = 0;
+				}
+				generate(Fsource, Fresponse, _bytes, FsourcePending);
+				if (FsourcePending == 0)
+				{
+					delete Fsource;
+					Fsource = nullptr;
+				}
+				particleSystem().heapAccount().reallocated(TheapAccount::RESPONSE, before, Fresponse.length());
+			}
+
 		public:
 			Tchannel() {}
+			~Tchannel() { delete Fsource; }
 
 			// management
 			size_t getBytesRemaining()
 			{
-				return (FbytesStart < Fresponse.length()) ? Fresponse.length() - FbytesStart : 0;
+				return ((FbytesStart < Fresponse.length()) ? Fresponse.length() - FbytesStart : 0) + FsourcePending;
 			}
-			bool idle() { return Fresponse.length() == 0; }
+			bool idle() { return Fresponse.length() == 0 && !Fsource; }
 			bool neverUsed() { return FlastUsed == 0; }
 			bool isOlder(system_tick_t _lastUsed)
 			{
 				return !neverUsed() && (_lastUsed == 0 || FlastUsed < _lastUsed);
 			}
 			system_tick_t lastUsed() { return FlastUsed; }
-			void release() { assign(""); }
+			void release() { assign(String()); }
 			void registerChannel(size_t _channel)
 			{
 				Fchannel = _channel;
@@ -713,12 +1003,23 @@ private:
 				size_t remaining = getBytesRemaining();
 				return remaining / DATA_SIZE + ((remaining % DATA_SIZE > 0) ? 1 : 0);
 			}
-			size_t assign(const String &_response)
-			{
-				Fresponse = _response;
-				FbytesStart = 0;
+			/**
+			 * @brief take over a response (moved, not copied), the first _start bytes are not sent via the channel
+			 * @param _source generates the remaining _pending bytes of the response while the channel is read (takes ownership)
+			 */
+			size_t assign(String &&_response, size_t _start = 0, TparticleResponseSource *_source = nullptr, size_t _pending = 0)
+			{
+				particleSystem().heapAccount().reallocated(TheapAccount::RESPONSE, Fresponse.length(), _response.length());
+				Fresponse = std::move(_response);
+				FbytesStart = (_start < Fresponse.length()) ? _start : Fresponse.length();
+				if (Fsource != _source)
+					delete Fsource;
+				Fsource = (_pending > 0) ? _source : nullptr;
+				FsourcePending = (Fsource) ? _pending : 0;
+				if (_source && !Fsource)
+					delete _source;
 				FlastUsed = millis();
-				if (_response.length() > 0)
+				if (getBytesRemaining() > 0)
 				{
 					Log.trace("assigned new value to channel '%c' (idx %d): %d bytes, %d transmissions: ",
 							  TparticleSerializer::encodeIntToBase64(Fchannel), Fchannel,
@@ -734,8 +1035,11 @@ private:
 				size_t remaining = getTransmissionsRemaining();
 				remaining = (remaining < 1) ? 0 : remaining - 1;
 				// format: transmissions remaining + actual data
-				String result = String(TparticleSerializer::encodeIntToBase64(remaining)) +
-								Fresponse.substring(FbytesStart, FbytesStart + DATA_SIZE);
+				fill(DATA_SIZE);
+				String result;
+				result.reserve(RESPONSE_SIZE);
+				result.concat(TparticleSerializer::encodeIntToBase64(remaining));
+				appendSlice(result, Fresponse, FbytesStart, DATA_SIZE);
 				if (remaining == 0)
 					release();
 				else
@@ -744,9 +1048,67 @@ private:
 			}
 		};
 
-		// array of channels (could be made a vector for flexible number of channels)
+		// array of channels
 		Tchannel Fchannels[N_CHANNELS];
 
+		// releases channels that were not read within the TTL
+		Ttimer FexpiryTimer;
+
+		/**
+		 * @brief (re)start the expiry timer for the busy channel that expires next
+		 */
+		void scheduleExpiry()
+		{
+			if (TTL_MS == 0)
+				return;
+			bool busy = false;
+			system_tick_t next = TTL_MS;
+			for (size_t i = 0; i < N_CHANNELS; i++)
+			{
+				if (Fchannels[i].idle())
+					continue;
+				system_tick_t age = millis() - Fchannels[i].lastUsed();
+				system_tick_t due = (age < TTL_MS) ? TTL_MS - age : 0;
+				if (due < next)
+					next = due;
+				busy = true;
+			}
+			if (busy)
+				FexpiryTimer.start(next);
+			else if (FexpiryTimer.running())
+				FexpiryTimer.stop();
+		}
+
+		// constructor
+		TparticleVariableResponse()
+		{
+			on(FexpiryTimer)
+			{
+				size_t expired = releaseIdle(TTL_MS);
+				if (expired > 0)
+					Log.trace("released %d response channel(s) not read for %lu ms", expired, static_cast<unsigned long>(TTL_MS));
+				scheduleExpiry();
+			};
+		}
+
+		/**
+		 * @brief release channels that were not read for a while (memory pressure)
+		 * @return number of released channels
+		 */
+		size_t releaseIdle(system_tick_t _idle_ms)
+		{
+			size_t released = 0;
+			for (size_t i = 0; i < N_CHANNELS; i++)
+			{
+				if (!Fchannels[i].idle() && millis() - Fchannels[i].lastUsed() >= _idle_ms)
+				{
+					Fchannels[i].release();
+					released++;
+				}
+			}
+			return released;
+		}
+
 		// register channels
 		void registerChannels()
 		{
@@ -756,8 +1118,8 @@ private:
 			}
 		}
 
-		// queue a message
-		String queue(const String &_response)
+		// queue a message (the response is moved into the channel, only the transmitted chunks are copied)
+		String queue(String _response)
 		{
 			//  any message
 			if (_response.length() == 0)
@@ -765,8 +1127,43 @@ private:
 			// message small enough for single transmission?
 			if (_response.length() < DATA_SIZE)
 			{
-				return "-" + _response; // - is the channel marker, i.e. no channel used
+				String single;
+				single.reserve(_response.length() + 1);
+				single.concat('-'); // - is the channel marker, i.e. no channel used
+				single.concat(_response);
+				return single;
+			}
+			return queueInitial(std::move(_response));
+		}
+
+		/**
+		 * @brief queue a generated message (takes ownership of the source)
+		 * only about one transmission of it is kept in memory at a time
+		 */
+		String queue(TparticleResponseSource *_source)
+		{
+			size_t pending = _source->length();
+			String response;
+			// message small enough for single transmission? --> generate right away
+			if (pending < DATA_SIZE)
+			{
+				response.reserve(pending);
+				generate(_source, response, pending, pending);
+				delete _source;
+				return queue(std::move(response));
 			}
+			response.reserve(INITIAL_SIZE + DATA_SIZE);
+			generate(_source, response, INITIAL_SIZE, pending);
+			return queueInitial(std::move(response), _source, pending);
+		}
+
+	private:
+		/**
+		 * @brief pick a channel for a message that needs more than one transmission
+		 * and return its initial transmission (the rest is handed over to the channel)
+		 */
+		String queueInitial(String &&_response, TparticleResponseSource *_source = nullptr, size_t _pending = 0)
+		{
 			// find channel to use
 			size_t channel = 0;
 			size_t oldestFreeChannel = 0;
@@ -801,18 +1198,141 @@ private:
 			{
 				channel = (oldestFreeLastUsed > 0) ? oldestFreeChannel : oldestInUseChannel;
 			}
-			// assign to channel and return initial message
+			// slice initial message, then hand the response over to the channel
 			// format: base64 channel ID + base64 remaining transmissions + actual data
-			size_t remaining = Fchannels[channel].assign(_response.substring(INITIAL_SIZE));
-			String initial = String(TparticleSerializer::encodeIntToBase64(channel)) +
-							 String(TparticleSerializer::encodeIntToBase64(remaining)) +
-							 _response.substring(0, INITIAL_SIZE);
+			String initial;
+			initial.reserve(RESPONSE_SIZE);
+			initial.concat(TparticleSerializer::encodeIntToBase64(channel));
+			initial.concat('-'); // placeholder for remaining transmissions
+			appendSlice(initial, _response, 0, INITIAL_SIZE);
+			size_t remaining = Fchannels[channel].assign(std::move(_response), INITIAL_SIZE, _source, _pending);
+			initial.setCharAt(1, TparticleSerializer::encodeIntToBase64(remaining));
+			scheduleExpiry();
 			return initial;
 		}
+	};
 
-	}
 	// particle variable response object
-	FvarResp;
+	TparticleVariableResponse<SDDS_PARTICLE_RESPONSE_CHANNELS, SDDS_PARTICLE_RESPONSE_SIZE, SDDS_PARTICLE_RESPONSE_TTL_MS> FvarResp;
+
+#pragma endregion
+
+/*** command log ***/
+#pragma region command log
+
+	/**
+	 * @brief log of the most recent commands (fixed ring of compact entries, the command texts are kept
+	 * back to back in a single buffer in the same order), rendered to JSON only when it is read
+	 * @note the size of each entry's JSON is estimated when it is added so the log can be trimmed
+	 * to the particle variable size limit without serializing it
+	 */
+	class TcommandLog
+	{
+
+	public:
+		const static size_t LOG_SIZE = particle::protocol::MAX_FUNCTION_ARG_LENGTH - 40; // reserve 40 chars for the time base
+		const static size_t MAX_ENTRIES = 64;
+
+	private:
+		struct Tentry
+		{
+			system_tick_t Ftime;   // millis() when the command was received
+			dtypes::int16 Fcode;   // return code
+			dtypes::uint16 Flength; // length of the command text
+			dtypes::uint16 Fbytes;  // JSON size of the entry (upper bound)
+		};
+		Tentry Fentries[MAX_ENTRIES];
+		size_t Ffirst = 0; // oldest entry
+		size_t Fcount = 0;
+		char Ftext[LOG_SIZE];
+		size_t FtextLength = 0;
+		size_t Fbytes = 2; // JSON size of the whole log ([])
+
+		static size_t digits(dtypes::int32 _value)
+		{
+			size_t n = (_value < 0) ? 2 : 1;
+			for (dtypes::uint32 v = (_value < 0) ? -_value : _value; v >= 10; v /= 10)
+				n++;
+			return n;
+		}
+
+		/**
+		 * @brief JSON size of the command text (with escaped characters)
+		 */
+		static size_t escapedLength(const char *_text, size_t _length)
+		{
+			size_t n = _length;
+			for (size_t i = 0; i < _length; ++i)
+			{
+				if (_text[i] == '"' || _text[i] == '\\')
+					n += 1;
+				else if (static_cast<unsigned char>(_text[i]) < 0x20)
+					n += 5;
+			}
+			return n;
+		}
+
+		void removeOldest()
+		{
+			Tentry &e = Fentries[Ffirst];
+			memmove(Ftext, Ftext + e.Flength, FtextLength - e.Flength);
+			FtextLength -= e.Flength;
+			Fbytes -= e.Fbytes;
+			Ffirst = (Ffirst + 1) % MAX_ENTRIES;
+			Fcount--;
+		}
+
+	public:
+		// constructor
+		TcommandLog()
+		{
+		}
+
+		/**
+		 * @brief add a command to the log (removes the oldest entries until it fits)
+		 */
+		void add(system_tick_t _time, const char *_cmd, size_t _length, int _code)
+		{
+			// time offset is estimated from the current oldest entry (it can only get smaller)
+			system_tick_t offset = (Fcount > 0) ? _time - Fentries[Ffirst].Ftime : 0;
+			size_t overhead = 6 + digits(static_cast<dtypes::int32>(offset)) + digits(_code); // [offset,"cmd",code] and the separator
+			if (overhead + 2 >= LOG_SIZE)
+				return;
+			// truncate commands that could never fit
+			while (_length > 0 && 2 + overhead + escapedLength(_cmd, _length) > LOG_SIZE)
+				_length--;
+			size_t bytes = overhead + escapedLength(_cmd, _length);
+			while (Fcount > 0 && (Fcount == MAX_ENTRIES || Fbytes + bytes > LOG_SIZE || FtextLength + _length > LOG_SIZE))
+				removeOldest();
+			memcpy(Ftext + FtextLength, _cmd, _length);
+			FtextLength += _length;
+			Fentries[(Ffirst + Fcount) % MAX_ENTRIES] = {_time, static_cast<dtypes::int16>(_code), static_cast<dtypes::uint16>(_length), static_cast<dtypes::uint16>(bytes)};
+			Fcount++;
+			Fbytes += bytes;
+		}
+
+		size_t count() { return Fcount; }
+		size_t bytes() { return Fbytes; } // estimated size of the JSON rendering
+
+		/**
+		 * @brief render the log as JSON
+		 */
+		String toJSON()
+		{
+			if (Fcount == 0)
+				return "[]";
+			Variant log;
+			size_t pos = 0;
+			system_tick_t refTime = Fentries[Ffirst].Ftime;
+			for (size_t i = 0; i < Fcount; ++i)
+			{
+				const Tentry &e = Fentries[(Ffirst + i) % MAX_ENTRIES];
+				log.append(TparticleSerializer::serializeCommand(e.Ftime - refTime, String(Ftext + pos, e.Flength), e.Fcode));
+				pos += e.Flength;
+			}
+			return TparticleSerializer::serializeCommandLog(refTime, log).toJSON();
+		}
+	};
 
 #pragma endregion
 
@@ -827,13 +1347,89 @@ private:
 		bool FnewBurstData = false;
 		system_tick_t FminTime = 0;						 // smallest burst data timestamp (to normalize against)
 		std::vector<TvarBurstDataset> FburstData;		 // data in current burst
+		size_t FburstBytes = 0;							 // encoded size of the current burst (when last serialized)
+		size_t FeventBytes = 0;							 // encoded size of the bursts in the current event
 		Ttimer FburstTimer;								 // timer keeping track of bursts
 		CloudEvent Fevent;								 // cloud event
 		VariantArray FeventData;						 // current event data
 		VariantArray FqueuedBursts;						 // stack of data ready for publishing
+		std::vector<dtypes::uint32> FeventTickets;		 // crash ring tickets of the event data (0 = not in the ring)
+		std::vector<dtypes::uint32> FqueuedTickets;		 // crash ring tickets of the queued data
 		const system_tick_t FpublishcheckInterval = 200; // publish status check timer [ms]
 		Ttimer FpublishCheckTimer;						 // publish check timer
 
+		// memory pressure
+		bool FeachPaused = false;								  // collection of publish::EACH values paused?
+		inline static const char *const SPILL_DIR = "/sdds";	  // spilled bursts location
+		inline static const char *const SPILL_FILE = "/sdds/spill"; // spilled bursts (length + CBOR per burst)
+		constexpr static int32_t MAX_SPILL_SIZE = 64 * 1024;	  // bursts beyond this stay queued in memory
+		bool FhasSpill = false;									  // are there spilled bursts to restore?
+		size_t FspillReadPos = 0;								  // restore position in the spill file
+
+		static int32_t spillSize()
+		{
+			struct stat s;
+			return (stat(SPILL_FILE, &s) == 0) ? static_cast<int32_t>(s.st_size) : -1;
+		}
+
+		/**
+		 * @brief move spilled bursts back into the queue (about one event's worth at a time)
+		 * @param _maxBursts restore at most this many bursts (e.g. 1 while memory is still low)
+		 */
+		void restoreSpilled(dtypes::uint32 _maxBursts = UINT32_MAX)
+		{
+			int32_t size = spillSize();
+			int fd = (size > 0) ? open(SPILL_FILE, O_RDONLY) : -1;
+			bool done = (fd < 0);
+			if (fd >= 0)
+			{
+				size_t bytes = 0;
+				dtypes::uint32 restored = 0;
+				lseek(fd, FspillReadPos, SEEK_SET);
+				while (bytes < 16 * particle::protocol::MAX_EVENT_DATA_LENGTH && restored < _maxBursts)
+				{
+					dtypes::uint32 length;
+					std::vector<char> cbor;
+					if (read(fd, &length, sizeof(length)) != sizeof(length) || length > 16 * particle::protocol::MAX_EVENT_DATA_LENGTH)
+					{
+						done = true;
+						break;
+					}
+					cbor.resize(length);
+					if (read(fd, cbor.data(), length) != static_cast<ssize_t>(length))
+					{
+						done = true;
+						break;
+					}
+					FspillReadPos += sizeof(length) + length;
+					bytes += length;
+					restored++;
+					String data(cbor.data(), length);
+					InputStringStream stream(data);
+					Variant burst;
+					if (decodeFromCBOR(burst, stream) == 0)
+						queueData(burst, length);
+					else
+						particleSystem().publishing.bursts.discarded++;
+				}
+				close(fd);
+				if (particleSystem().publishing.bursts.spilled > restored)
+					particleSystem().publishing.bursts.spilled -= restored;
+				else if (particleSystem().publishing.bursts.spilled > 0)
+					particleSystem().publishing.bursts.spilled = 0;
+			}
+			if (done)
+			{
+				// everything restored (or the rest is unreadable)
+				unlink(SPILL_FILE);
+				particleSystem().reportFileSize(size, -1);
+				FhasSpill = false;
+				FspillReadPos = 0;
+				if (particleSystem().publishing.bursts.spilled > 0)
+					particleSystem().publishing.bursts.spilled = 0;
+			}
+		}
+
 		/**
 		 * @brief check if we're ready to publish (need a name and valid time)
 		 */
@@ -852,27 +1448,60 @@ private:
 		}
 
 		/**
-		 * @brief clear burst
+		 * @brief the bursts of the current event are sent (or discarded) --> release them from the crash ring
 		 */
-		void clearBurst()
+		void eventDone()
 		{
-			FnewBurstData = false;
-			FburstData.clear();
-			FminTime = 0;
+			for (dtypes::uint32 ticket : FeventTickets)
+				releaseTicket(ticket);
+			FeventTickets.clear();
 		}
 
-	public:
-		// constructor + logic
+		/**
+		 * @brief release a burst from the crash ring (no-op for ticket 0 or without SDDS_PARTICLE_CRASH_RING)
+		 */
+		static void releaseTicket(dtypes::uint32 _ticket)
+		{
+#ifdef SDDS_PARTICLE_CRASH_RING
+			crashRing().done(_ticket);
+#endif
+		}
+
+		/**
+		 * @brief clear burst
+		 */
+		void clearBurst()
+		{
+			FnewBurstData = false;
+			FburstData.clear();
+			particleSystem().heapAccount().released(TheapAccount::BURST, FburstBytes);
+			FburstBytes = 0;
+			FminTime = 0;
+		}
+
+	public:
+		// constructor + logic
 		TparticlePublisher()
 		{
 
 			// data bursts
 			on(FburstTimer)
 			{
+				sdds_profile(BURST);
 				Variant burst = TparticleSerializer::serializeBurst(FminTime, FburstData);
+				size_t bytes = getCBORSize(burst);
+				particleSystem().heapAccount().reallocated(TheapAccount::BURST, FburstBytes, bytes);
+				FburstBytes = bytes;
 				if (readyToPublish())
 				{
-					queueData(burst);
+					dtypes::uint32 ticket = 0;
+#ifdef SDDS_PARTICLE_CRASH_RING
+					// small bursts are also kept in retained RAM until they're sent
+					if (bytes <= TcrashRing::SLOT_SIZE)
+						ticket = crashRing().add(TparticleSerializer::variantToCbor(burst));
+#endif
+					if (!queueData(burst, bytes, ticket))
+						releaseTicket(ticket);
 					clearBurst();
 				}
 				else
@@ -893,6 +1522,7 @@ private:
 			// data publishing
 			on(FpublishCheckTimer)
 			{
+				sdds_profile(PUBLISH_QUEUE);
 
 				// check ongoing cloud event
 				if (!Fevent.isNew() && !Fevent.isSending())
@@ -901,11 +1531,15 @@ private:
 					{
 						Log.trace("publish succeeded");
 						particleSystem().publishing.bursts.sent += particleSystem().publishing.bursts.sending;
+						particleSystem().heapAccount().released(TheapAccount::QUEUE, FeventBytes);
+						eventDone();
 					}
 					else if (!Fevent.isValid())
 					{
 						Log.trace("publish failed, invalid (error %d, discarding)", Fevent.error());
 						particleSystem().publishing.bursts.invalid += particleSystem().publishing.bursts.sending;
+						particleSystem().heapAccount().released(TheapAccount::QUEUE, FeventBytes);
+						eventDone();
 					}
 					else if (!Fevent.isOk())
 					{
@@ -916,26 +1550,39 @@ private:
 							FqueuedBursts.append(var); // add what is in eventData back at the end of the queue
 							particleSystem().publishing.bursts.queued++;
 						}
+						FqueuedTickets.insert(FqueuedTickets.end(), FeventTickets.begin(), FeventTickets.end());
+						FeventTickets.clear();
 					}
 					Fevent.clear();
+					FeventBytes = 0;
 					particleSystem().publishing.bursts.sending = 0;
 				}
 
+				// restore spilled bursts once the queue is empty (one at a time while memory is still low)
+				if (FhasSpill && FqueuedBursts.isEmpty() && Particle.connected() && !Fevent.isSending())
+					restoreSpilled(particleSystem().memoryPressure() ? 1 : UINT32_MAX);
+
 				// check if new cloud event can be sent
 				if (!FqueuedBursts.isEmpty() && Particle.connected() && !Fevent.isSending())
 				{
 					FeventData = VariantArray();
+					FeventTickets.clear();
+					FeventBytes = 0;
 					size_t cborSize = 0;
 					// pack as much of the queued data into the event as is possible with the 16kb limit and what can currently be published given what's in flight
 					// https://docs.particle.io/reference/device-os/typed-publish/
 					while (!FqueuedBursts.isEmpty() && cborSize <= 16 * particle::protocol::MAX_EVENT_DATA_LENGTH && Fevent.canPublish(cborSize))
 					{
-						cborSize += getCBORSize(FqueuedBursts[0]);
+						size_t bytes = getCBORSize(FqueuedBursts[0]);
+						cborSize += bytes;
 						if (cborSize <= 16 * particle::protocol::MAX_EVENT_DATA_LENGTH)
 						{
 							// add to event data and remove from queue
 							FeventData.append(FqueuedBursts[0]);
 							FqueuedBursts.removeAt(0);
+							FeventTickets.push_back(FqueuedTickets.front());
+							FqueuedTickets.erase(FqueuedTickets.begin());
+							FeventBytes += bytes;
 						}
 					}
 					// finalize event (if it holds any data)
@@ -950,6 +1597,9 @@ private:
 						{
 							Log.error("published failed immediately, discarding");
 							Fevent.clear();
+							eventDone();
+							particleSystem().heapAccount().released(TheapAccount::QUEUE, FeventBytes);
+							FeventBytes = 0;
 							particleSystem().publishing.bursts.invalid += particleSystem().publishing.bursts.sending;
 							particleSystem().publishing.bursts.sending = 0;
 						}
@@ -957,7 +1607,7 @@ private:
 				}
 
 				// check in again?
-				if (Fevent.isSending() || particleSystem().publishing.bursts.queued > 0)
+				if (Fevent.isSending() || particleSystem().publishing.bursts.queued > 0 || FhasSpill)
 					FpublishCheckTimer.start(FpublishcheckInterval);
 			};
 		}
@@ -1026,10 +1676,19 @@ private:
 		 * @return true if successfully queued, false if too large to be queued
 		 */
 		bool queueData(const Variant &_data)
+		{
+			return queueData(_data, getCBORSize(_data));
+		}
+
+		/**
+		 * @brief queues Variant for publication (with its already known encoded size)
+		 * @param _ticket crash ring ticket of the data (0 if it's not kept in the crash ring)
+		 */
+		bool queueData(const Variant &_data, size_t _bytes, dtypes::uint32 _ticket = 0)
 		{
 			// safety check if data is small enough (less than 16kB)
 			// https://docs.particle.io/reference/device-os/typed-publish/
-			if (getCBORSize(_data) > 16 * particle::protocol::MAX_EVENT_DATA_LENGTH)
+			if (_bytes > 16 * particle::protocol::MAX_EVENT_DATA_LENGTH)
 			{
 				// burst too large!
 				Log.error("cannot queue data because it exceeds the 16kB cloud event limit");
@@ -1042,19 +1701,129 @@ private:
 			// add to event data queue stack
 			Log.trace("*** QUEUEING DATA: ***");
 			FqueuedBursts.append(_data);
+			FqueuedTickets.push_back(_ticket);
 			printVariant(_data);
 			particleSystem().publishing.bursts.queued++;
+			particleSystem().heapAccount().allocated(TheapAccount::QUEUE, _bytes);
 			if (!FpublishCheckTimer.running())
 				FpublishCheckTimer.start(0);
 			return true;
 		}
 
+		/**
+		 * @brief move the queued bursts to flash (memory pressure, up to MAX_SPILL_SIZE), they are restored once the queue is empty
+		 * @return number of spilled bursts
+		 */
+		size_t spillQueue()
+		{
+			if (FqueuedBursts.isEmpty())
+				return 0;
+			mkdir(SPILL_DIR, 0755);
+			int32_t oldSize = spillSize();
+			if (oldSize >= MAX_SPILL_SIZE)
+				return 0;
+			int fd = open(SPILL_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+			if (fd < 0)
+				return 0;
+			size_t spilled = 0;
+			size_t bytes = 0;
+			size_t fileSize = std::max<int32_t>(oldSize, 0);
+			while (!FqueuedBursts.isEmpty())
+			{
+				String cbor = TparticleSerializer::variantToCbor(FqueuedBursts[0]);
+				dtypes::uint32 length = cbor.length();
+				if (length == 0 || fileSize + sizeof(length) + length > MAX_SPILL_SIZE ||
+					write(fd, &length, sizeof(length)) != sizeof(length) ||
+					write(fd, cbor.c_str(), length) != static_cast<ssize_t>(length))
+					break;
+				FqueuedBursts.removeAt(0);
+				releaseTicket(FqueuedTickets.front()); // safe on flash
+				FqueuedTickets.erase(FqueuedTickets.begin());
+				spilled++;
+				bytes += length;
+				fileSize += sizeof(length) + length;
+			}
+			fsync(fd);
+			close(fd);
+			particleSystem().reportFileSize(oldSize, spillSize());
+			if (spilled > 0)
+			{
+				Log.warn("spilled %u bursts (%u bytes) to flash", static_cast<unsigned>(spilled), static_cast<unsigned>(bytes));
+				FhasSpill = true;
+				particleSystem().publishing.bursts.queued -= spilled;
+				particleSystem().publishing.bursts.spilled += spilled;
+				particleSystem().heapAccount().released(TheapAccount::QUEUE, bytes);
+			}
+			return spilled;
+		}
+
+		/**
+		 * @brief pick up spilled bursts (e.g. from before a restart) and restore them when possible
+		 */
+		void checkSpill()
+		{
+			if (!FhasSpill)
+			{
+				FspillReadPos = 0;
+				FhasSpill = (spillSize() > 0);
+			}
+			if (FhasSpill && !FpublishCheckTimer.running())
+				FpublishCheckTimer.start(0);
+		}
+
+		/**
+		 * @brief keep only the latest value of each variable in the current burst (memory pressure)
+		 */
+		void mergeBurst()
+		{
+			for (TvarBurstDataset &data : FburstData)
+			{
+				if (data.Fdataset.size() > 1)
+				{
+					data.Fdataset.erase(data.Fdataset.begin(), data.Fdataset.end() - 1);
+					data.Fdataset.shrink_to_fit();
+				}
+			}
+		}
+
+		void pauseEach(bool _pause) { FeachPaused = _pause; }
+		bool eachPaused() { return FeachPaused; }
+
 	}
 	// publisher object
 	Fpublisher;
 
 #pragma endregion
 
+/*** memory pressure ***/
+#pragma region memory pressure
+
+	// response channels that were not read for this long are released under memory pressure
+	const static system_tick_t RESPONSE_IDLE_MS = 5000;
+
+	/**
+	 * @brief apply a memory pressure stage (see TparticleSystem::handleMemoryPressure)
+	 */
+	void relieveMemory(TparticleSystem::TmemoryStage::e _stage)
+	{
+		if (_stage == TparticleSystem::TmemoryStage::none)
+		{
+			// recovered (spilled bursts are restored by the publisher)
+			Fpublisher.pauseEach(false);
+			Fpublisher.checkSpill();
+		}
+		else if (_stage == TparticleSystem::TmemoryStage::releaseChannels)
+			FvarResp.releaseIdle(RESPONSE_IDLE_MS);
+		else if (_stage == TparticleSystem::TmemoryStage::spillBursts)
+			Fpublisher.spillQueue();
+		else if (_stage == TparticleSystem::TmemoryStage::mergeBursts)
+			Fpublisher.mergeBurst();
+		else if (_stage == TparticleSystem::TmemoryStage::pauseEach)
+			Fpublisher.pauseEach(true);
+	}
+
+#pragma endregion
+
 /*** automatic publishing of sdds variables  ***/
 #pragma region variables publish
 
@@ -1074,6 +1843,62 @@ private:
 		TparticleVariableIntervals() {}
 	} sddsParticleVariables;
 
+	/**
+	 * @brief all variable intervals sorted by their origin (for fast lookups by Tdescr*)
+	 */
+	class TparticleVarInterval;
+	std::vector<TparticleVarInterval *> FvarIndex;
+
+	/**
+	 * @brief classes of publish intervals (each has its own list of variable intervals)
+	 */
+	enum intervalClass
+	{
+		NO_INTERVAL = 0,	 // publish::OFF
+		GLOBAL_INTERVAL = 1, // publish::AVG_GLOBAL
+		CHANGE_INTERVAL = 2, // publish::EACH and publish::ALWAYS
+		CUSTOM_INTERVAL = 3, // own timer
+		N_INTERVAL_CLASSES = 4
+	};
+
+	/**
+	 * @brief intrusive (doubly linked) list of the variable intervals in an interval class
+	 */
+	class TvarIntervalList
+	{
+	private:
+		TparticleVarInterval *Ffirst = nullptr;
+		size_t Fcount = 0;
+
+	public:
+		TparticleVarInterval *first() { return Ffirst; }
+		size_t count() { return Fcount; }
+
+		void add(TparticleVarInterval *_pvi)
+		{
+			_pvi->FprevInList = nullptr;
+			_pvi->FnextInList = Ffirst;
+			if (Ffirst)
+				Ffirst->FprevInList = _pvi;
+			Ffirst = _pvi;
+			Fcount++;
+		}
+
+		void remove(TparticleVarInterval *_pvi)
+		{
+			if (_pvi->FprevInList)
+				_pvi->FprevInList->FnextInList = _pvi->FnextInList;
+			else
+				Ffirst = _pvi->FnextInList;
+			if (_pvi->FnextInList)
+				_pvi->FnextInList->FprevInList = _pvi->FprevInList;
+			_pvi->FprevInList = nullptr;
+			_pvi->FnextInList = nullptr;
+			Fcount--;
+		}
+	};
+	TvarIntervalList FintervalLists[N_INTERVAL_CLASSES];
+
 	/**
 	 * @brief menu handle with provided name
 	 */
@@ -1087,154 +1912,209 @@ private:
 	};
 
 	/**
-	 * @brief keeps track of the publish intervals (see setVariableInterval), provides access to the original sdds var, and defines the reset() and publish() methods
+	 * @brief does the publishing for a single sdds var (see setVariableInterval), provides access to the original sdds var, and defines the reset() and publish() methods
+	 * @note wrappers are not sdds vars themselves, the publish interval is kept in the TparticleVarInterval that owns the wrapper
+	 * @note the virtual interface is only for the rare operations (interval changes, resets, publishing), the per-sample
+	 * callback path is statically dispatched in TparticleTypedVarWrapper
 	 */
-	class TparticleVarWrapper : public Tint32
+	class TparticleVarWrapper
+	{
+	protected:
+		// publish interval and origin
+		Tint32 *Finterval = nullptr;
+		Tdescr *FvarOrigin = nullptr;
+		Tdescr *FlinkedUnit = nullptr;
+
+		// publishing
+		TparticlePublisher *Fpublisher = nullptr;
+
+	public:
+		TparticleVarWrapper(Tint32 *_interval, Tdescr *_voi, TparticlePublisher *_pub, Tdescr *_unit) : Finterval(_interval), FvarOrigin(_voi), FlinkedUnit(_unit), Fpublisher(_pub)
+		{
+		}
+		virtual ~TparticleVarWrapper() {}
+
+		// interval and original sdds var access
+		dtypes::int32 interval() { return Finterval->Fvalue; }
+		Tdescr *origin() { return FvarOrigin; }
+
+		/**
+		 * @brief (re)start publishing after the publish interval changed
+		 */
+		virtual void restart() = 0;
+
+		/**
+		 * @brief reset the data storage
+		 */
+		virtual void reset() = 0;
+
+		/**
+		 * @brief adds to the burst of the publisher
+		 */
+		virtual void publish() = 0;
+
+		/**
+		 * @brief keep an on-device history of the values (only supported for numeric vars)
+		 * @return whether the history is enabled
+		 */
+		virtual bool enableHistory(const ThistoryConfig &_config) { return false; }
+
+		/**
+		 * @brief the on-device history (nullptr if not enabled)
+		 */
+		virtual TvarHistory *history() { return nullptr; }
+	};
+
+	/**
+	 * @brief implements the wrapper logic for a specific wrapper class (CRTP) so that the
+	 * per-sample calls to isValueDifferent(), storePreviousValue(), changeValue(),
+	 * getTimeForPublish() and getDataForPublish() are resolved at compile time
+	 * @tparam Twrapper the derived wrapper class, can hide any of the default implementations
+	 */
+	template <class Twrapper>
+	class TparticleTypedVarWrapper : public TparticleVarWrapper
 	{
 	private:
 		// timer and callback wrappers
 		Ttimer Ftimer;
-		TcallbackWrapper FintervalCbw{this};
-		TcallbackWrapper ForiginCbw{this};
+		TcallbackWrapper ForiginCbw;
 
-	protected:
-		// origin
-		Tdescr *FvarOrigin = nullptr;
-		Tdescr *FlinkedUnit = nullptr;
+		// static dispatch to the derived wrapper
+		Twrapper *self() { return static_cast<Twrapper *>(this); }
 
+	protected:
 		// previous value
 		bool FhasPreviousValue = false;
-		virtual void storePreviousValue() = 0;
-		virtual bool isValueDifferent() = 0;
 
 		// publishing
-		TparticlePublisher *Fpublisher = nullptr;
 		system_tick_t FlastUpdateTime = 0;
-		virtual void clear() {}
-		virtual void changeValue()
+		void clear() {}
+		void recordHistory() {}
+		void changeValue()
 		{
-			if (!FhasPreviousValue || isValueDifferent())
+			if (!FhasPreviousValue || self()->isValueDifferent())
 			{
 				// by default, only update if the value is different
 				FlastUpdateTime = millis();
 			}
 		}
-		virtual system_tick_t getTimeForPublish()
+		system_tick_t getTimeForPublish()
 		{
 			// default is the last update time
 			return FlastUpdateTime;
 		}
-		virtual Variant getDataForPublish()
+		Variant getDataForPublish()
 		{
 			// default is just the value of the variable
 			return TparticleSerializer::serializeData(FvarOrigin, FlinkedUnit);
 		}
 
 	public:
-		TparticleVarWrapper(Tdescr *_voi, TparticlePublisher *_pub, Tdescr *_unit) : FvarOrigin(_voi), Fpublisher(_pub), FlinkedUnit(_unit)
+		TparticleTypedVarWrapper(Tint32 *_interval, Tdescr *_voi, TparticlePublisher *_pub, Tdescr *_unit) : TparticleVarWrapper(_interval, _voi, _pub, _unit), ForiginCbw(_interval)
 		{
-			Fvalue = publish::OFF;
-
 			// call back for origin value change
 			ForiginCbw = [this](void *_ctx)
 			{
-				// only start collecting values once startup is complete
-				if (particleSystem().startup == TparticleSystem::TstartupStatus::complete)
-				{
-					if (Fvalue == publish::EACH || Fvalue == publish::ALWAYS)
-					{
-						// publish current variable value immediately (but only if it has changed!)
-						if (!FhasPreviousValue || isValueDifferent())
-							publish();
-					}
-					else
-					{
-						// collect values
-						changeValue();
-					}
-				}
-				// keep track of previous value
-				storePreviousValue();
-				if (!FhasPreviousValue)
-					FhasPreviousValue = true;
-			};
-
-			// call back for the publish interval changing
-			FintervalCbw = [this](void *_ctx)
-			{
-				// reset callback, timer and values
-				FvarOrigin->callbacks()->remove(&ForiginCbw);
-				Ftimer.stop();
-				reset();
-
-				// no publishing for this variable
-				if (Fvalue == publish::OFF)
-					return;
-
-				// add publish callback
-				FvarOrigin->callbacks()->push_first(&ForiginCbw);
-
-				// if Fvalue is set > MAX --> start own timer
-				if (Fvalue > publish::MAX)
-				{
-					if (Fvalue < 1000)
-						Fvalue = 1000; // min interval is 1 second
-					Ftimer.start(Fvalue);
-				}
+				sdds_profile(VAR_SAMPLE);
+				handleSample();
 			};
-			callbacks()->addCbw(FintervalCbw);
 
 			// trigger publish
 			on(Ftimer)
 			{
+				sdds_profile(VAR_PUBLISH);
 				// publish (only does anything if there's data)
 				publish();
 				// restart timer
-				Ftimer.start(Fvalue);
+				Ftimer.start(interval());
 			};
 		}
 
-		// setting the interval values
-		void operator=(Tint32::dtype _v) { __setValue(_v); }
-		template <typename T>
-		void operator=(T _val) { __setValue(_val); }
-
-		// original sdds var access
-		Tdescr *origin() { return FvarOrigin; }
-		Tmeta meta() override { return Tmeta{Tint32::TYPE_ID, sdds::opt::saveval, FvarOrigin->name()}; }
-
 		/**
-		 * @brief does this use the global publishing interval?
+		 * @brief the origin callback (no virtual calls)
 		 */
-		bool usesGlobalPublishingInterval()
+		void handleSample()
 		{
-			return (Fvalue == publish::AVG_GLOBAL);
+			// only start collecting values once startup is complete
+			if (particleSystem().startup == TparticleSystem::TstartupStatus::complete)
+			{
+				// on-device history (if any)
+				self()->recordHistory();
+
+				if (interval() == publish::OFF)
+				{
+					// not publishing (only here for the history)
+				}
+				else if (interval() == publish::EACH && Fpublisher && Fpublisher->eachPaused())
+				{
+					// paused due to memory pressure
+				}
+				else if (interval() == publish::EACH || interval() == publish::ALWAYS)
+				{
+					// publish current variable value immediately (but only if it has changed!)
+					if (!FhasPreviousValue || self()->isValueDifferent())
+						publishCurrent();
+				}
+				else
+				{
+					// collect values
+					self()->changeValue();
+				}
+			}
+			// keep track of previous value
+			self()->storePreviousValue();
+			if (!FhasPreviousValue)
+				FhasPreviousValue = true;
 		}
 
-		// methods implemented in derived classes
-		/**
-		 * @brief reset the data storage
-		 */
-		void reset()
+		void restart() override
+		{
+			// reset callback, timer and values
+			FvarOrigin->callbacks()->remove(&ForiginCbw);
+			Ftimer.stop();
+			reset();
+
+			// no publishing and no history for this variable
+			if (interval() == publish::OFF && !history())
+				return;
+
+			// add publish callback
+			FvarOrigin->callbacks()->push_first(&ForiginCbw);
+
+			// if the interval is set > MAX --> start own timer
+			if (interval() > publish::MAX)
+			{
+				if (interval() < 1000)
+					Finterval->Fvalue = 1000; // min interval is 1 second
+				Ftimer.start(interval());
+			}
+		}
+
+		void reset() override
 		{
 			FlastUpdateTime = 0; // reset to no value
-			clear();
+			self()->clear();
 		}
 
 		/**
-		 * @brief adds to the burst of the publisher
+		 * @brief adds the current value to the burst of the publisher
 		 */
-		void publish()
+		void publishCurrent()
+		{
+			if (Fpublisher)
+				Fpublisher->addToBurst(FvarOrigin, millis(), TparticleSerializer::serializeData(FvarOrigin, FlinkedUnit), interval() == publish::ALWAYS);
+		}
+
+		void publish() override
 		{
 			// is publishing off for this variable? --> stop
-			if (Fvalue == publish::OFF)
+			if (interval() == publish::OFF)
 				return;
 
 			// is publishing immediate or always? --> publish current value (whatever it is)
-			if (Fvalue == publish::EACH || Fvalue == publish::ALWAYS)
+			if (interval() == publish::EACH || interval() == publish::ALWAYS)
 			{
-				if (Fpublisher)
-					Fpublisher->addToBurst(FvarOrigin, millis(), TparticleSerializer::serializeData(FvarOrigin, FlinkedUnit), Fvalue == publish::ALWAYS);
+				publishCurrent();
 				return;
 			}
 
@@ -1244,7 +2124,7 @@ private:
 
 			// okay publishing the collected data
 			if (Fpublisher)
-				Fpublisher->addToBurst(FvarOrigin, getTimeForPublish(), getDataForPublish(), Fvalue == publish::ALWAYS);
+				Fpublisher->addToBurst(FvarOrigin, self()->getTimeForPublish(), self()->getDataForPublish(), interval() == publish::ALWAYS);
 			reset();
 		}
 	};
@@ -1252,8 +2132,9 @@ private:
 	/**
 	 * @brief wrapper for string SDDS vars
 	 */
-	class TparticleStringVarWrapper : public TparticleVarWrapper
+	class TparticleStringVarWrapper : public TparticleTypedVarWrapper<TparticleStringVarWrapper>
 	{
+		friend class TparticleTypedVarWrapper<TparticleStringVarWrapper>;
 
 	private:
 		dtypes::string FpreviousValue;
@@ -1264,18 +2145,68 @@ private:
 			return (static_cast<Tstring *>(origin())->Fvalue);
 		}
 
-		void storePreviousValue() override
+		void storePreviousValue()
 		{
 			FpreviousValue = originValue();
 		}
 
-		bool isValueDifferent() override
+		bool isValueDifferent()
 		{
 			return (FpreviousValue != originValue());
 		}
 
 	public:
-		TparticleStringVarWrapper(Tdescr *_voi, TparticlePublisher *_pub, Tdescr *_unit) : TparticleVarWrapper(_voi, _pub, _unit)
+		TparticleStringVarWrapper(Tint32 *_interval, Tdescr *_voi, TparticlePublisher *_pub, Tdescr *_unit) : TparticleTypedVarWrapper(_interval, _voi, _pub, _unit)
+		{
+		}
+	};
+
+	/**
+	 * @brief wrapper for string SDDS vars that only keeps the length and a 64-bit hash
+	 * of the previous value instead of a full copy (see SDDS_PARTICLE_STRING_HASH)
+	 * @note identical length and hash are treated as an unchanged value, with a 64-bit
+	 * hash a collision between two successive values is vanishingly unlikely
+	 */
+	class TparticleHashedStringVarWrapper : public TparticleTypedVarWrapper<TparticleHashedStringVarWrapper>
+	{
+		friend class TparticleTypedVarWrapper<TparticleHashedStringVarWrapper>;
+
+	private:
+		size_t FpreviousLength = 0;
+		dtypes::uint64 FpreviousHash = 0;
+
+		// hash of the current value if isValueDifferent() already calculated it for this sample
+		bool FhasCurrentHash = false;
+		dtypes::uint64 FcurrentHash = 0;
+
+	protected:
+		const dtypes::string &originValue()
+		{
+			return (static_cast<Tstring *>(origin())->Fvalue);
+		}
+
+		void storePreviousValue()
+		{
+			const dtypes::string &value = originValue();
+			FpreviousLength = value.length();
+			FpreviousHash = FhasCurrentHash ? FcurrentHash : TstringHash::hash(value.c_str(), FpreviousLength);
+			FhasCurrentHash = false;
+		}
+
+		bool isValueDifferent()
+		{
+			const dtypes::string &value = originValue();
+			// different length is a cheap first check, only hash if the length is the same
+			if (FpreviousLength != value.length())
+				return true;
+			// keep the hash for storePreviousValue() (called at the end of the same sample)
+			FcurrentHash = TstringHash::hash(value.c_str(), value.length());
+			FhasCurrentHash = true;
+			return (FpreviousHash != FcurrentHash);
+		}
+
+	public:
+		TparticleHashedStringVarWrapper(Tint32 *_interval, Tdescr *_voi, TparticlePublisher *_pub, Tdescr *_unit) : TparticleTypedVarWrapper(_interval, _voi, _pub, _unit)
 		{
 		}
 	};
@@ -1283,8 +2214,9 @@ private:
 	/**
 	 * @brief wrapper for enum SDDS vars
 	 */
-	class TparticleEnumVarWrapper : public TparticleVarWrapper
+	class TparticleEnumVarWrapper : public TparticleTypedVarWrapper<TparticleEnumVarWrapper>
 	{
+		friend class TparticleTypedVarWrapper<TparticleEnumVarWrapper>;
 
 	private:
 		dtypes::uint8 FpreviousValue;
@@ -1295,18 +2227,18 @@ private:
 			return (*static_cast<dtypes::uint8 *>(static_cast<TenumBase *>(origin())->pValue()));
 		}
 
-		void storePreviousValue() override
+		void storePreviousValue()
 		{
 			FpreviousValue = originValue();
 		}
 
-		bool isValueDifferent() override
+		bool isValueDifferent()
 		{
 			return (FpreviousValue != originValue());
 		}
 
 	public:
-		TparticleEnumVarWrapper(Tdescr *_voi, TparticlePublisher *_pub, Tdescr *_unit) : TparticleVarWrapper(_voi, _pub, _unit)
+		TparticleEnumVarWrapper(Tint32 *_interval, Tdescr *_voi, TparticlePublisher *_pub, Tdescr *_unit) : TparticleTypedVarWrapper(_interval, _voi, _pub, _unit)
 		{
 		}
 	};
@@ -1319,13 +2251,17 @@ private:
 	 * resulting JSON though
 	 */
 	template <class sdds_dtype>
-	class TparticleNumericVarWrapper : public TparticleVarWrapper
+	class TparticleNumericVarWrapper : public TparticleTypedVarWrapper<TparticleNumericVarWrapper<sdds_dtype>>
 	{
+		friend class TparticleTypedVarWrapper<TparticleNumericVarWrapper<sdds_dtype>>;
 
 	private:
 		// keep track of data
 		TrunningStats rs;
 
+		// on-device history
+		TvarHistory *Fhistory = nullptr;
+
 		// keeping track of time
 		bool FhasFirstValue = false;
 		dtypes::TtickCount FstartTime = 0;	// start time of the averaged value
@@ -1352,20 +2288,26 @@ private:
 		// origin value changes
 		typedef typename sdds_dtype::dtype value_dtype;
 		value_dtype FpreviousValue;
-		sdds_dtype *typedOrigin() { return static_cast<sdds_dtype *>(origin()); }
+		sdds_dtype *typedOrigin() { return static_cast<sdds_dtype *>(this->origin()); }
 		value_dtype originValue() { return typedOrigin()->Fvalue; }
 
-		void storePreviousValue() override
+		void storePreviousValue()
 		{
 			FpreviousValue = originValue();
 		}
 
-		bool isValueDifferent() override
+		bool isValueDifferent()
 		{
 			return (FpreviousValue != originValue());
 		}
 
-		void clear() override
+		void recordHistory()
+		{
+			if (Fhistory && Time.isValid())
+				Fhistory->add(Time.now(), static_cast<dtypes::float64>(originValue()));
+		}
+
+		void clear()
 		{
 			// already have one data point stored in the running stats
 			// --> start next stats with FlatestValue
@@ -1377,7 +2319,7 @@ private:
 				changeValue();
 		}
 
-		void changeValue() override
+		void changeValue()
 		{
 			// always triggers update for continuously collected values even if value is the same
 			this->FlastUpdateTime = millis();
@@ -1390,7 +2332,7 @@ private:
 			addLatest();
 		}
 
-		system_tick_t getTimeForPublish() override
+		system_tick_t getTimeForPublish()
 		{
 			if (rs.count() == 0)
 			{
@@ -1404,7 +2346,7 @@ private:
 			}
 		}
 
-		Variant getDataForPublish() override
+		Variant getDataForPublish()
 		{
 			if (rs.count() == 0)
 			{
@@ -1420,8 +2362,229 @@ private:
 		}
 
 	public:
-		TparticleNumericVarWrapper(Tdescr *_voi, TparticlePublisher *_pub, Tdescr *_unit) : TparticleVarWrapper(_voi, _pub, _unit)
+		TparticleNumericVarWrapper(Tint32 *_interval, Tdescr *_voi, TparticlePublisher *_pub, Tdescr *_unit) : TparticleTypedVarWrapper<TparticleNumericVarWrapper<sdds_dtype>>(_interval, _voi, _pub, _unit)
+		{
+		}
+		~TparticleNumericVarWrapper()
+		{
+			delete Fhistory;
+		}
+
+		bool enableHistory(const ThistoryConfig &_config) override
+		{
+			if (!Fhistory)
+				Fhistory = new TvarHistory();
+			if (Fhistory->setup(_config))
+				return true;
+			// not enough memory
+			delete Fhistory;
+			Fhistory = nullptr;
+			return false;
+		}
+
+		TvarHistory *history() override
 		{
+			return Fhistory;
+		}
+	};
+
+	/**
+	 * @brief which interval class does a publish interval belong to?
+	 */
+	static intervalClass intervalClassOf(dtypes::int32 _interval)
+	{
+		if (_interval == publish::OFF)
+			return NO_INTERVAL;
+		if (_interval == publish::AVG_GLOBAL)
+			return GLOBAL_INTERVAL;
+		if (_interval == publish::EACH || _interval == publish::ALWAYS)
+			return CHANGE_INTERVAL;
+		return CUSTOM_INTERVAL;
+	}
+
+	/**
+	 * @brief create the wrapper matching the data type of the sdds var
+	 * @return nullptr if the data type is not supported
+	 */
+	static TparticleVarWrapper *createVarWrapper(Tint32 *_interval, Tdescr *_voi, TparticlePublisher *_pub, Tdescr *_unit)
+	{
+		auto dt = _voi->type();
+		// string wrapper
+		if (dt == sdds::Ttype::STRING)
+#ifdef SDDS_PARTICLE_STRING_HASH
+			return new TparticleHashedStringVarWrapper(_interval, _voi, _pub, _unit);
+#else
+			return new TparticleStringVarWrapper(_interval, _voi, _pub, _unit);
+#endif
+		// enum wrapper
+		else if (dt == sdds::Ttype::ENUM)
+			return new TparticleEnumVarWrapper(_interval, _voi, _pub, _unit);
+		// numeric wrappers
+		else if (dt == sdds::Ttype::UINT8)
+			return new TparticleNumericVarWrapper<Tuint8>(_interval, _voi, _pub, _unit);
+		else if (dt == sdds::Ttype::UINT16)
+			return new TparticleNumericVarWrapper<Tuint16>(_interval, _voi, _pub, _unit);
+		else if (dt == sdds::Ttype::UINT32)
+			return new TparticleNumericVarWrapper<Tuint32>(_interval, _voi, _pub, _unit);
+		else if (dt == sdds::Ttype::INT8)
+			return new TparticleNumericVarWrapper<Tint8>(_interval, _voi, _pub, _unit);
+		else if (dt == sdds::Ttype::INT16)
+			return new TparticleNumericVarWrapper<Tint16>(_interval, _voi, _pub, _unit);
+		else if (dt == sdds::Ttype::INT32)
+			return new TparticleNumericVarWrapper<Tint32>(_interval, _voi, _pub, _unit);
+		else if (dt == sdds::Ttype::FLOAT32)
+			return new TparticleNumericVarWrapper<Tfloat32>(_interval, _voi, _pub, _unit);
+		else if (dt == sdds::Ttype::FLOAT64)
+			return new TparticleNumericVarWrapper<Tfloat64>(_interval, _voi, _pub, _unit);
+		// FIXME: is anything else supported?
+		return nullptr;
+	}
+
+	/**
+	 * @brief is there a wrapper for this data type?
+	 */
+	static bool isWrappable(sdds::Ttype _dt)
+	{
+		return _dt == sdds::Ttype::STRING || _dt == sdds::Ttype::ENUM ||
+			   _dt == sdds::Ttype::UINT8 || _dt == sdds::Ttype::UINT16 || _dt == sdds::Ttype::UINT32 ||
+			   _dt == sdds::Ttype::INT8 || _dt == sdds::Ttype::INT16 || _dt == sdds::Ttype::INT32 ||
+			   _dt == sdds::Ttype::FLOAT32 || _dt == sdds::Ttype::FLOAT64;
+	}
+
+	/**
+	 * @brief the publish interval of a single sdds var in the variable intervals tree
+	 * in sparse mode (SDDS_PARTICLE_SPARSE_INTERVALS), the wrapper that does the actual
+	 * publishing is only created once the interval is set to something other than OFF
+	 * (by setupDefaults, a command, or loaded state) and freed again when it is set back to OFF
+	 * (unless the variable keeps a history), otherwise it is created right away and kept
+	 * @note keeping the interval and the wrapper apart costs a few pointers and a heap block per variable
+	 * in the default mode (~50 bytes on the 32-bit devices incl. the interval lists and the lookup index)
+	 */
+	class TparticleVarInterval : public Tint32
+	{
+		friend class TvarIntervalList;
+
+	private:
+		TcallbackWrapper FintervalCbw{this};
+		Tdescr *FvarOrigin = nullptr;
+		Tdescr *FlinkedUnit = nullptr;
+		TparticlePublisher *Fpublisher = nullptr;
+		TparticleVarWrapper *Fwrapper = nullptr;
+
+		// interval class lists
+		TvarIntervalList *Flists = nullptr;
+		intervalClass Fclass = NO_INTERVAL;
+		TparticleVarInterval *FprevInList = nullptr;
+		TparticleVarInterval *FnextInList = nullptr;
+
+		/**
+		 * @brief move to the list of the current interval class
+		 */
+		void updateIntervalClass()
+		{
+			intervalClass newClass = intervalClassOf(Fvalue);
+			if (newClass == Fclass)
+				return;
+			Flists[Fclass].remove(this);
+			Fclass = newClass;
+			Flists[Fclass].add(this);
+		}
+
+		/**
+		 * @brief create the wrapper (if it doesn't exist yet)
+		 */
+		TparticleVarWrapper *ensureWrapper()
+		{
+			if (!Fwrapper)
+				Fwrapper = createVarWrapper(this, FvarOrigin, Fpublisher, FlinkedUnit);
+			return Fwrapper;
+		}
+
+	public:
+		TparticleVarInterval(Tdescr *_voi, TparticlePublisher *_pub, Tdescr *_unit, TvarIntervalList *_lists) : FvarOrigin(_voi), FlinkedUnit(_unit), Fpublisher(_pub), Flists(_lists)
+		{
+			Fvalue = publish::OFF;
+			Flists[Fclass].add(this);
+
+			// call back for the publish interval changing
+			FintervalCbw = [this](void *_ctx)
+			{
+				// keep the interval class lists up to date
+				updateIntervalClass();
+
+				// nothing to do if publishing was never turned on for this variable
+				if (Fvalue == publish::OFF && !Fwrapper)
+					return;
+				// (re)start publishing
+				if (ensureWrapper())
+					Fwrapper->restart();
+#ifdef SDDS_PARTICLE_SPARSE_INTERVALS
+				// back to OFF (and no history) --> free the wrapper again
+				if (Fvalue == publish::OFF && Fwrapper && !Fwrapper->history())
+				{
+					delete Fwrapper;
+					Fwrapper = nullptr;
+				}
+#endif
+			};
+			callbacks()->addCbw(FintervalCbw);
+
+#ifndef SDDS_PARTICLE_SPARSE_INTERVALS
+			// not sparse --> create the wrapper right away
+			ensureWrapper();
+#endif
+		}
+
+		// setting the interval values
+		void operator=(Tint32::dtype _v) { __setValue(_v); }
+		template <typename T>
+		void operator=(T _val) { __setValue(_val); }
+
+		// original sdds var access
+		Tdescr *origin() { return FvarOrigin; }
+		Tmeta meta() override { return Tmeta{Tint32::TYPE_ID, sdds::opt::saveval, FvarOrigin->name()}; }
+
+		// wrapper access (nullptr if it has not been created yet)
+		TparticleVarWrapper *wrapper() { return Fwrapper; }
+
+		/**
+		 * @brief keep an on-device history of the values (only supported for numeric vars)
+		 */
+		bool enableHistory(const ThistoryConfig &_config)
+		{
+			if (!ensureWrapper() || !Fwrapper->enableHistory(_config))
+				return false;
+			Fwrapper->restart();
+			return true;
+		}
+
+		/**
+		 * @brief does this use the global publishing interval?
+		 */
+		bool usesGlobalPublishingInterval()
+		{
+			return (Fvalue == publish::AVG_GLOBAL);
+		}
+
+		// next in the list of this interval class
+		TparticleVarInterval *nextInList() { return FnextInList; }
+
+		/**
+		 * @brief reset the data storage
+		 */
+		void reset()
+		{
+			if (Fwrapper)
+				Fwrapper->reset();
+		}
+
+		/**
+		 * @brief adds to the burst of the publisher
+		 */
+		void publish()
+		{
+			if (Fwrapper)
+				Fwrapper->publish();
 		}
 	};
 
@@ -1444,29 +2607,13 @@ private:
 			}
 
 			auto dt = d->type();
-			// string wrapper
-			if (dt == sdds::Ttype::STRING)
-				_dst->addDescr(new TparticleStringVarWrapper(d, &Fpublisher, linkedUnit));
-			// enum wrapper
-			else if (dt == sdds::Ttype::ENUM)
-				_dst->addDescr(new TparticleEnumVarWrapper(d, &Fpublisher, linkedUnit));
-			// numeric wrappers
-			else if (dt == sdds::Ttype::UINT8)
-				_dst->addDescr(new TparticleNumericVarWrapper<Tuint8>(d, &Fpublisher, linkedUnit));
-			else if (dt == sdds::Ttype::UINT16)
-				_dst->addDescr(new TparticleNumericVarWrapper<Tuint16>(d, &Fpublisher, linkedUnit));
-			else if (dt == sdds::Ttype::UINT32)
-				_dst->addDescr(new TparticleNumericVarWrapper<Tuint32>(d, &Fpublisher, linkedUnit));
-			else if (dt == sdds::Ttype::INT8)
-				_dst->addDescr(new TparticleNumericVarWrapper<Tint8>(d, &Fpublisher, linkedUnit));
-			else if (dt == sdds::Ttype::INT16)
-				_dst->addDescr(new TparticleNumericVarWrapper<Tint16>(d, &Fpublisher, linkedUnit));
-			else if (dt == sdds::Ttype::INT32)
-				_dst->addDescr(new TparticleNumericVarWrapper<Tint32>(d, &Fpublisher, linkedUnit));
-			else if (dt == sdds::Ttype::FLOAT32)
-				_dst->addDescr(new TparticleNumericVarWrapper<Tfloat32>(d, &Fpublisher, linkedUnit));
-			else if (dt == sdds::Ttype::FLOAT64)
-				_dst->addDescr(new TparticleNumericVarWrapper<Tfloat64>(d, &Fpublisher, linkedUnit));
+			// variable interval
+			if (isWrappable(dt))
+			{
+				TparticleVarInterval *pvi = new TparticleVarInterval(d, &Fpublisher, linkedUnit, FintervalLists);
+				_dst->addDescr(pvi);
+				FvarIndex.push_back(pvi);
+			}
 			// recursive through structure
 			else if (dt == sdds::Ttype::STRUCT)
 			{
@@ -1488,59 +2635,20 @@ private:
 	{
 		createVariableIntervalsTree(_src, &sddsParticleVariables);
 		particleSystem().publishing.addDescr(&sddsParticleVariables);
+		// sort the origin index for binary search lookups
+		std::sort(FvarIndex.begin(), FvarIndex.end(), [](TparticleVarInterval *_a, TparticleVarInterval *_b)
+				  { return std::less<Tdescr *>()(_a->origin(), _b->origin()); });
 	}
 
 	/**
-	 * @brief set defaults for variables intervals tree
-	 * @param _default value to set
-	 * @param _optsFilter options filter
-	 * @param _dtypes data types filter
+	 * @brief find the variable interval for a specific variable (binary search in the origin index)
+	 * @return nullptr if _var is not in any of the variable intervals' origin
 	 */
-	void setVariableIntervalsDefault(TmenuHandle *_vars, dtypes::int32 _default, int _optsFilter, const std::vector<sdds::Ttype> &_dtypes)
+	TparticleVarInterval *findVarInterval(Tdescr *_var)
 	{
-		if (_default > publish::MAX && _default < 1000)
-			_default = 1000; // min interval is 1 second
-		for (auto it = _vars->iterator(); it.hasCurrent(); it.jumpToNext())
-		{
-			auto d = it.current();
-			if (!d)
-				continue;
-			if (d->type() == sdds::Ttype::STRUCT)
-			{
-				TmenuHandle *mh = static_cast<Tstruct *>(d)->value();
-				if (mh)
-				{
-					setVariableIntervalsDefault(mh, _default, _optsFilter, _dtypes);
-				}
-			}
-			else
-			{
-				TparticleVarWrapper *pvw = static_cast<TparticleVarWrapper *>(d);
-				if (_optsFilter >= 0)
-				{
-					// opts filter is active, check if d has the requested option(s)
-					if ((pvw->origin()->meta().option & _optsFilter) != _optsFilter)
-						continue;
-				}
-				if (!_dtypes.empty())
-				{
-					// dtypes are provided, make sure it's one of them
-					bool is_in_dtypes = false;
-					for (size_t i = 0; i < _dtypes.size(); ++i)
-					{
-						if (pvw->origin()->type() == _dtypes[i])
-						{
-							is_in_dtypes = true;
-							break;
-						}
-					}
-					if (!is_in_dtypes)
-						continue;
-				}
-				// opts filter and dtypes filter didn't throw us out --> set interval to the provided default
-				pvw->__setValue(_default);
-			}
-		}
+		auto it = std::lower_bound(FvarIndex.begin(), FvarIndex.end(), _var, [](TparticleVarInterval *_pvi, Tdescr *_d)
+								   { return std::less<Tdescr *>()(_pvi->origin(), _d); });
+		return (it != FvarIndex.end() && (*it)->origin() == _var) ? *it : nullptr;
 	}
 
 	/**
@@ -1555,36 +2663,15 @@ private:
 	 * 1000+ 	-> publish every 1000+ ms
 	 * @return whether _var was found in any of the variable intervals' origin
 	 */
-	bool setVariableInterval(TmenuHandle *_vars, dtypes::int32 _interval, Tdescr *_var)
+	bool setVariableInterval(dtypes::int32 _interval, Tdescr *_var)
 	{
 		if (_interval > publish::MAX && _interval < 1000)
 			_interval = 1000; // min interval is 1 second
-		for (auto it = _vars->iterator(); it.hasCurrent(); it.jumpToNext())
-		{
-			auto d = it.current();
-			if (!d)
-				continue;
-			if (d->type() == sdds::Ttype::STRUCT)
-			{
-				TmenuHandle *mh = static_cast<Tstruct *>(d)->value();
-				if (mh)
-				{
-					if (setVariableInterval(mh, _interval, _var))
-						return true;
-				}
-			}
-			else
-			{
-				TparticleVarWrapper *pvw = static_cast<TparticleVarWrapper *>(d);
-				if (pvw->origin() == _var)
-				{
-					// found the matching wrapper
-					pvw->__setValue(_interval);
-					return true;
-				}
-			}
-		}
-		return false;
+		TparticleVarInterval *pvi = findVarInterval(_var);
+		if (!pvi)
+			return false;
+		pvi->__setValue(_interval);
+		return true;
 	}
 
 	/**
@@ -1594,70 +2681,127 @@ private:
 	 */
 	bool publishVariable(Tdescr *_var)
 	{
-		return publishVariable(&sddsParticleVariables, _var);
-	}
-
-	// actual function
-	bool publishVariable(TmenuHandle *_vars, Tdescr *_var)
-	{
-		for (auto it = _vars->iterator(); it.hasCurrent(); it.jumpToNext())
-		{
-			auto d = it.current();
-			if (!d)
-				continue;
-			if (d->type() == sdds::Ttype::STRUCT)
-			{
-				TmenuHandle *mh = static_cast<Tstruct *>(d)->value();
-				if (mh)
-				{
-					if (publishVariable(mh, _var))
-						return true;
-				}
-			}
-			else
-			{
-				TparticleVarWrapper *pvw = static_cast<TparticleVarWrapper *>(d);
-				if (pvw->origin() == _var)
-				{
-					// found the matching wrapper
-					pvw->publish();
-					return true;
-				}
-			}
-		}
-		return false;
+		TparticleVarInterval *pvi = findVarInterval(_var);
+		if (!pvi)
+			return false;
+		pvi->publish();
+		return true;
 	}
 
 	/**
 	 * @brief publishing interval default
+	 * matches a single variable, a path pattern (e.g. "adc*.voltage", "pump.**"), and/or options/data types
 	 */
 	struct TintervalDefault
 	{
 		dtypes::int32 Finterval;
 		Tdescr *Fvar = nullptr;
+		TpathPattern Fpattern;
 		dtypes::int16 FoptsFilter = -1;
 		std::vector<sdds::Ttype> FdtypeFilter = {};
 		TintervalDefault(dtypes::int32 _interval, Tdescr *_var) : Finterval(_interval), Fvar(_var) {}
+		TintervalDefault(dtypes::int32 _interval, const char *_pattern) : Finterval(_interval), Fpattern(_pattern) {}
 		TintervalDefault(dtypes::int32 _interval, const std::vector<sdds::Ttype> &_dtypes) : Finterval(_interval), FdtypeFilter(_dtypes) {}
 		TintervalDefault(dtypes::int32 _interval, dtypes::int16 _opts) : Finterval(_interval), FoptsFilter(_opts) {}
 		TintervalDefault(dtypes::int32 _interval, dtypes::int16 _opts, const std::vector<sdds::Ttype> &_dtypes) : Finterval(_interval), FoptsFilter(_opts), FdtypeFilter(_dtypes) {}
+		TintervalDefault(dtypes::int32 _interval, const char *_pattern, dtypes::int16 _opts, const std::vector<sdds::Ttype> &_dtypes = {}) : Finterval(_interval), Fpattern(_pattern), FoptsFilter(_opts), FdtypeFilter(_dtypes) {}
+
+		/**
+		 * @brief does this default apply to the variable?
+		 */
+		bool matches(Tdescr *_var) const
+		{
+			if (Fvar && Fvar != _var)
+				return false;
+			if (FoptsFilter >= 0 && (_var->meta().option & FoptsFilter) != FoptsFilter)
+				return false;
+			if (!FdtypeFilter.empty() && std::find(FdtypeFilter.begin(), FdtypeFilter.end(), _var->type()) == FdtypeFilter.end())
+				return false;
+			if (!Fpattern.isEmpty() && !Fpattern.match(_var))
+				return false;
+			return true;
+		}
 	};
 
+	/**
+	 * @brief set the interval of a variable from a default
+	 */
+	static void applyIntervalDefault(TparticleVarInterval *_pvi, dtypes::int32 _interval)
+	{
+		if (_interval > publish::MAX && _interval < 1000)
+			_interval = 1000; // min interval is 1 second
+		_pvi->__setValue(_interval);
+	}
+
+	/**
+	 * @brief apply interval defaults, single variable defaults are looked up in the origin index,
+	 * only pattern/option/data type rules need a pass over all variable intervals
+	 * @note the defaults are applied in order, i.e. if several match a variable the last one wins
+	 * @return the number of variables whose interval was set
+	 */
+	size_t applyIntervalDefaults(const std::vector<TintervalDefault> &_defaults)
+	{
+		// single variable defaults (variable interval + index of the default) and rules (index of the default)
+		typedef std::pair<TparticleVarInterval *, size_t> TsingleDefault;
+		std::vector<TsingleDefault> singles;
+		std::vector<size_t> rules;
+		for (size_t i = 0; i < _defaults.size(); ++i)
+		{
+			if (!_defaults[i].Fvar)
+			{
+				rules.push_back(i);
+				continue;
+			}
+			TparticleVarInterval *pvi = findVarInterval(_defaults[i].Fvar);
+			if (pvi && _defaults[i].matches(pvi->origin()))
+				singles.push_back(TsingleDefault(pvi, i));
+		}
+		// sort by variable, stable so the last default of each variable stays last
+		std::stable_sort(singles.begin(), singles.end(), [](const TsingleDefault &_a, const TsingleDefault &_b)
+						 { return std::less<TparticleVarInterval *>()(_a.first, _b.first); });
+
+		size_t count = 0;
+		if (rules.empty())
+		{
+			// only single variable defaults --> no pass over all variables
+			for (size_t i = 0; i < singles.size(); ++i)
+			{
+				if (i + 1 < singles.size() && singles[i + 1].first == singles[i].first)
+					continue; // a later default for the same variable wins
+				applyIntervalDefault(singles[i].first, _defaults[singles[i].second].Finterval);
+				count++;
+			}
+			return count;
+		}
+
+		for (TparticleVarInterval *pvi : FvarIndex)
+		{
+			// last matching rule
+			int last = -1;
+			for (size_t i : rules)
+			{
+				if (_defaults[i].matches(pvi->origin()))
+					last = i;
+			}
+			// last single default for this variable (if it comes after the rule)
+			auto single = std::upper_bound(singles.begin(), singles.end(), pvi, [](TparticleVarInterval *_pvi, const TsingleDefault &_single)
+										   { return std::less<TparticleVarInterval *>()(_pvi, _single.first); });
+			if (single != singles.begin() && (single - 1)->first == pvi && static_cast<int>((single - 1)->second) > last)
+				last = (single - 1)->second;
+			if (last < 0)
+				continue;
+			applyIntervalDefault(pvi, _defaults[last].Finterval);
+			count++;
+		}
+		return count;
+	}
+
 	/**
 	 * @brief default during setup
 	 */
 	void setupDefaults(const std::vector<TintervalDefault> &_defaults)
 	{
-		// set defaults
-		for (size_t i = 0; i < _defaults.size(); ++i)
-		{
-			if (_defaults[i].Fvar)
-				// single variable default
-				setVariableInterval(&sddsParticleVariables, _defaults[i].Finterval, _defaults[i].Fvar);
-			else
-				// default by opts/type filter
-				setVariableIntervalsDefault(&sddsParticleVariables, _defaults[i].Finterval, _defaults[i].FoptsFilter, _defaults[i].FdtypeFilter);
-		}
+		applyIntervalDefaults(_defaults);
 	}
 
 	/**
@@ -1665,28 +2809,8 @@ private:
 	 */
 	void resetGlobal()
 	{
-		resetGlobal(&sddsParticleVariables);
-	}
-	void resetGlobal(TmenuHandle *_vars)
-	{
-		for (auto it = _vars->iterator(); it.hasCurrent(); it.jumpToNext())
-		{
-			auto d = it.current();
-			if (!d)
-				continue;
-			if (d->type() == sdds::Ttype::STRUCT)
-			{
-				TmenuHandle *mh = static_cast<Tstruct *>(d)->value();
-				if (mh)
-					resetGlobal(mh);
-			}
-			else
-			{
-				TparticleVarWrapper *pvw = static_cast<TparticleVarWrapper *>(d);
-				if (pvw->usesGlobalPublishingInterval())
-					pvw->reset();
-			}
-		}
+		for (TparticleVarInterval *pvi = FintervalLists[GLOBAL_INTERVAL].first(); pvi; pvi = pvi->nextInList())
+			pvi->reset();
 	}
 
 	/**
@@ -1694,28 +2818,9 @@ private:
 	 */
 	void publishGlobal()
 	{
-		publishGlobal(&sddsParticleVariables);
-	}
-	void publishGlobal(TmenuHandle *_dst)
-	{
-		for (auto it = _dst->iterator(); it.hasCurrent(); it.jumpToNext())
-		{
-			auto d = it.current();
-			if (!d)
-				continue;
-			if (d->type() == sdds::Ttype::STRUCT)
-			{
-				TmenuHandle *mh = static_cast<Tstruct *>(d)->value();
-				if (mh)
-					publishGlobal(mh);
-			}
-			else
-			{
-				TparticleVarWrapper *pvw = static_cast<TparticleVarWrapper *>(d);
-				if (pvw->usesGlobalPublishingInterval())
-					pvw->publish();
-			}
-		}
+		sdds_profile(PUBLISH_GLOBAL);
+		for (TparticleVarInterval *pvi = FintervalLists[GLOBAL_INTERVAL].first(); pvi; pvi = pvi->nextInList())
+			pvi->publish();
 	}
 
 #pragma endregion
@@ -1727,9 +2832,67 @@ private:
 	// sdds structure
 	TmenuHandle *Froot = nullptr;
 
+	// flat depth-first index of the sdds structure (built during setup)
+	TdescrIndex FdescrIndex;
+
+	// index entries of SYSTEM (incl. the publishing intervals), not counted by the numeric variable ids
+	TdescrIndex::Trange FsystemIds = {0, 0};
+
 	// whether to reset the state/EEPROM
 	bool FresetState = false;
 
+	// whether to recover the crash ring (after a PANIC, watchdog or out-of-memory restart)
+	bool FrecoverCrash = false;
+
+	/**
+	 * @brief mark the startup complete and publish the startup info (once the state is loaded)
+	 */
+	void completeStartup()
+	{
+		particleSystem().markBootPhase(TparticleSystem::BOOT_STATE_LOADED);
+
+		// mark startup complete now that state is loaded
+		particleSystem().startup = TparticleSystem::TstartupStatus::complete;
+		particleSystem().markBootPhase(TparticleSystem::BOOT_COMPLETE);
+
+#ifdef SDDS_PARTICLE_CRASH_RING
+		// data from before a crash
+		if (FrecoverCrash)
+			recoverCrash();
+#endif
+
+		// publish startup info (will publish no matter what if these vars are set to ALWAYS)
+		publishVariable(&particleSystem().vitals.lastRestart);
+		publishVariable(&particleSystem().state.status);
+
+		// publish state if we're publishing and autosend on startup is on
+		if (particleSystem().publishing.record == TonOff::ON && particleSystem().state.autoSendOnStartup == TonOff::ON)
+		{
+			publishState("");
+		}
+	}
+
+#ifdef SDDS_PARTICLE_CRASH_RING
+	/**
+	 * @brief queue the bursts and counters kept in retained RAM before the crash
+	 */
+	void recoverCrash()
+	{
+		size_t recovered = 0;
+		String cbor;
+		for (size_t i = 0; crashRing().pendingBurst(i, cbor); ++i)
+		{
+			InputStringStream stream(cbor);
+			Variant burst;
+			if (decodeFromCBOR(burst, stream) == 0 && Fpublisher.queueData(burst, cbor.length()))
+				recovered++;
+		}
+		Log.warn("recovered %u bursts from before the crash", static_cast<unsigned>(recovered));
+		Fpublisher.queueData(TparticleSerializer::serializeCrashReport(crashRing().counters(), recovered));
+		crashRing().clear();
+	}
+#endif
+
 	// plain comms handler to process sdds variable commands
 	TplainCommHandler Fpch;
 
@@ -1741,44 +2904,164 @@ private:
 	constexpr static int ERR_NO_CMD = -200;
 	constexpr static int ERR_CMDS_MAX = -201;
 	constexpr static int ERR_EVENT_SIZE_MAX = -202;
+	constexpr static int ERR_NO_HISTORY = -203;
+	constexpr static int ERR_RULE_FORMAT = -204;
+	constexpr static int ERR_BATCH_REJECTED = -205;
+	constexpr static int ERR_DECODE = -206;
+	constexpr static int ERR_CHUNK = -207;
 
-	// command log
-	system_tick_t FcmdLogMinTime = 0; // earliest time in the log
-	char FcmdLog[particle::protocol::MAX_FUNCTION_ARG_LENGTH] = "[]\0";
+	// history selection (see sddsHistory)
+	Tdescr *FhistoryVar = nullptr;
+	time32_t FhistorySeconds = 0;
 
-	void logCommand(system_tick_t _time, const String &_cmd, int _errCode, const char *_errText)
+	/**
+	 * @brief getSddsHistory response that serializes one history entry at a time while the response
+	 * channel is read, the entries are fixed when the response is created (newer ones are not included,
+	 * ones that are overwritten before they are sent are skipped)
+	 * @note the length is the upper bound for the number of entries (the longest possible entry each),
+	 * so nothing is serialized up front, the shorter actual response is padded with spaces
+	 */
+	class ThistoryResponse : public TparticleResponseSource
 	{
-		// append to sddslog cloud var Variant array
-		Variant cmd_log = TparticleSerializer::deserializeCommandLog(FcmdLog);
-		Variant new_cmd = TparticleSerializer::serializeCommand(_time - FcmdLogMinTime, _cmd, _errCode, _errText);
-		cmd_log.append(new_cmd);
-		size_t msg_log_size = cmd_log.toJSON().length(); // reserve 40 chars for timebase
-		while (msg_log_size >= (particle::protocol::MAX_FUNCTION_ARG_LENGTH - 40) && !cmd_log.isEmpty())
+	private:
+		// which part of the response comes next
+		enum Tpart
+		{
+			PREFIX,
+			ENTRIES,
+			CURRENT,
+			SUFFIX,
+			DONE
+		};
+
+		TvarHistory *Fhistory;
+		TvarHistory::Tresolution Fres;
+		time32_t FtimeBase = 0;
+		size_t Fstart = 0;			// position of the first entry
+		size_t Fend = 0;			// position after the last entry
+		ThistoryAggregate Fcurrent; // open aggregation period (aggregates only)
+		String Fprefix;
+		String Fsuffix;
+
+		// progress
+		Tpart Fpart = PREFIX;
+		size_t Fpos = 0;
+		bool Ffirst = true;
+
+		void separate(String &_dest)
 		{
-			// remove the oldest entries until they fit
-			cmd_log.removeAt(0);
-			msg_log_size = cmd_log.toJSON().length();
+			if (!Ffirst)
+				_dest.concat(',');
+			Ffirst = false;
 		}
-		// time offset
-		if (!cmd_log.isEmpty())
+
+	public:
+		ThistoryResponse(Tdescr *_d, TvarHistory *_history, time32_t _from) : Fhistory(_history), Fres(_history->resolutionFor(_from))
 		{
-			// store back in the cloud log particle variable
-			system_tick_t timeRebaseShift = 0;
-			if (cmd_log[0].isArray() && !cmd_log[0].isEmpty())
+			if (Fres == TvarHistory::RAW)
 			{
-				// rebased based on first entry if there is one
-				timeRebaseShift = cmd_log[0][0].toUInt();
+				const TringBuffer<ThistorySample> &raw = _history->raw();
+				size_t i = 0;
+				while (i < raw.size() && raw.at(i).Ftime < _from)
+					i++;
+				if (i < raw.size())
+					FtimeBase = raw.at(i).Ftime;
+				Fstart = raw.position(i);
+				Fend = raw.endPosition();
 			}
-			Variant log = TparticleSerializer::serializeCommandLog(FcmdLogMinTime, timeRebaseShift, cmd_log);
-			snprintf(FcmdLog, particle::protocol::MAX_FUNCTION_ARG_LENGTH, "%s", log.toJSON().c_str());
-			FcmdLogMinTime = FcmdLogMinTime + timeRebaseShift;
+			else
+			{
+				const TringBuffer<ThistoryAggregate> &aggs = _history->aggregates(Fres);
+				size_t i = 0;
+				while (i < aggs.size() && aggs.at(i).Ftime + Fres <= _from)
+					i++;
+				if (i < aggs.size())
+					FtimeBase = aggs.at(i).Ftime;
+				Fstart = aggs.position(i);
+				Fend = aggs.endPosition();
+				Fcurrent = _history->current(Fres);
+				if (FtimeBase == 0 && Fcurrent.Fstats.count() > 0)
+					FtimeBase = Fcurrent.Ftime;
+			}
+			TparticleSerializer::serializeHistoryFrame(_d, Fres, FtimeBase, Fprefix, Fsuffix);
+			Fpos = Fstart;
 		}
-		else
+
+		size_t length() override
+		{
+			size_t entries = Fend - Fstart;
+			size_t entryMax = TparticleSerializer::HISTORY_SAMPLE_MAX;
+			if (Fres != TvarHistory::RAW)
+			{
+				entryMax = TparticleSerializer::HISTORY_AGGREGATE_MAX;
+				if (Fcurrent.Fstats.count() > 0)
+					entries++;
+			}
+			return Fprefix.length() + entries * (entryMax + 1) + Fsuffix.length(); // + separators
+		}
+
+		bool next(String &_dest) override
 		{
-			// nothing to store
-			FcmdLogMinTime = 0;
-			snprintf(FcmdLog, particle::protocol::MAX_FUNCTION_ARG_LENGTH, "[]");
+			if (Fpart == PREFIX)
+			{
+				_dest.concat(Fprefix);
+				Fpart = ENTRIES;
+				return true;
+			}
+			if (Fpart == ENTRIES)
+			{
+				while (Fpos < Fend)
+				{
+					size_t pos = Fpos++;
+					if (Fres == TvarHistory::RAW)
+					{
+						const ThistorySample *sample = Fhistory->raw().atPosition(pos);
+						if (!sample)
+							continue; // overwritten
+						separate(_dest);
+						TparticleSerializer::serializeHistorySample(_dest, FtimeBase, *sample);
+					}
+					else
+					{
+						const ThistoryAggregate *agg = Fhistory->aggregates(Fres).atPosition(pos);
+						if (!agg)
+							continue; // overwritten
+						separate(_dest);
+						TparticleSerializer::serializeHistoryAggregate(_dest, FtimeBase, *agg);
+					}
+					return true;
+				}
+				Fpart = CURRENT;
+			}
+			if (Fpart == CURRENT)
+			{
+				Fpart = SUFFIX;
+				if (Fres != TvarHistory::RAW && Fcurrent.Fstats.count() > 0)
+				{
+					separate(_dest);
+					TparticleSerializer::serializeHistoryAggregate(_dest, FtimeBase, Fcurrent);
+					return true;
+				}
+			}
+			if (Fpart == SUFFIX)
+			{
+				_dest.concat(Fsuffix);
+				Fpart = DONE;
+				return true;
+			}
+			return false;
 		}
+	};
+
+	// command log
+	TcommandLog FcmdLog;
+
+	void logCommand(system_tick_t _time, const String &_cmd, int _errCode)
+	{
+		sdds_profile(COMMAND_LOG);
+		size_t before = FcmdLog.bytes();
+		FcmdLog.add(_time, _cmd.c_str(), _cmd.length(), _errCode);
+		particleSystem().heapAccount().reallocated(TheapAccount::COMMAND_LOG, before, FcmdLog.bytes());
 	}
 
 	/**
@@ -1786,6 +3069,7 @@ private:
 	 */
 	int setVariables(String _cmd)
 	{
+		sdds_profile(COMMAND);
 		// parse _cmds into individual commands
 		std::vector<String> cmds;
 		system_tick_t timestamp = millis();
@@ -1829,36 +3113,201 @@ private:
 		int returnValue = 0;
 		for (size_t i = 0; i < cmds.size(); ++i)
 		{
-			Fpch.resetLastError();
-			Fpch.handleMessage(cmds[i]);
-			if (Fpch.lastError() == plainComm::Terror::e::___)
+			int code = runCommand(cmds[i]);
+			if (code == 0)
 			{
 				// success
-				logCommand(timestamp, cmds[i], 0, "");
+				logCommand(timestamp, cmds[i], 0);
 			}
 			else
 			{
 				// fail
 				returnValue |= (1 << i);
-				logCommand(timestamp, cmds[i],
-						   plainComm::Terror::toInt(Fpch.lastError()),
-						   plainComm::Terror::c_str(Fpch.lastError()));
+				logCommand(timestamp, cmds[i], code);
 				if (cmds.size() == 1)
 				{
 					// single command --> return its code as negative
-					return -plainComm::Terror::toInt(Fpch.lastError());
+					return -code;
 				}
 			}
 		}
 		return returnValue;
 	}
 
+	/**
+	 * @brief run a single command, assignments (path=value) are resolved via the path table of the flat index
+	 * anything else (and assignments that cannot be applied) go through the plain comm handler as before
+	 * so the error codes stay the same
+	 * @return 0 on success, otherwise the plainComm error code
+	 */
+	int runCommand(String &_cmd)
+	{
+		int eq = _cmd.indexOf('=');
+		if (eq > 0)
+		{
+			// resolve the path in place (temporarily terminated at the '=')
+			_cmd.setCharAt(eq, '\0');
+			Tdescr *var = findVar(_cmd.c_str());
+			_cmd.setCharAt(eq, '=');
+			if (var && !var->isStruct() && !var->isReadonly() && var->setValue(_cmd.c_str() + eq + 1))
+				return 0;
+		}
+		Fpch.resetLastError();
+		Fpch.handleMessage(_cmd);
+		return plainComm::Terror::toInt(Fpch.lastError());
+	}
+
+	/**
+	 * @brief Particle.function sddsBatch
+	 * same format as sdds (path=value assignments separated by spaces) but all assignments are
+	 * validated first and then applied together (or not at all), each changed variable is notified once
+	 * @note there is no limit on the number of assignments, the result of each one is in the command log
+	 * @return the number of assignments applied or ERR_BATCH_REJECTED if any of them was invalid
+	 */
+	int executeBatch(String _cmd)
+	{
+		sdds_profile(COMMAND);
+		system_tick_t timestamp = millis();
+		if (_cmd.length() == 0)
+			return (ERR_NO_CMD);
+
+		// tokenize in place (terminate each command and temporarily split path and value)
+		char *buffer = &_cmd[0];
+		TcommandBatch batch;
+		for (char *c = buffer; *c != '\0';)
+		{
+			if (*c == ' ')
+			{
+				c++;
+				continue;
+			}
+			char *cmd = c;
+			while (*c != ' ' && *c != '\0')
+				c++;
+			size_t length = c - cmd;
+			if (*c != '\0')
+				*c++ = '\0';
+			char *eq = strchr(cmd, '=');
+			Tdescr *var = nullptr;
+			if (eq)
+			{
+				*eq = '\0';
+				var = findVar(cmd);
+				*eq = '=';
+			}
+			batch.add(cmd, length, var, (eq) ? eq + 1 : nullptr);
+		}
+
+		return runBatch(batch, timestamp);
+	}
+
+	/**
+	 * @brief apply a command batch and log the result of each command
+	 * @return the number of commands applied or ERR_BATCH_REJECTED if any of them was invalid
+	 */
+	int runBatch(TcommandBatch &_batch, system_tick_t _timestamp)
+	{
+		// got anything?
+		if (_batch.size() == 0)
+			return (ERR_NO_CMD);
+
+		// apply and log results
+		bool applied = _batch.execute();
+		{
+			sdds_profile(COMMAND_LOG);
+			size_t before = FcmdLog.bytes();
+			for (size_t i = 0; i < _batch.size(); ++i)
+			{
+				int code = (_batch[i].Fcode == TcommandBatch::NOT_APPLIED) ? ERR_BATCH_REJECTED : _batch[i].Fcode;
+				FcmdLog.add(_timestamp, _batch[i].Fcmd, _batch[i].FcmdLength, code);
+			}
+			particleSystem().heapAccount().reallocated(TheapAccount::COMMAND_LOG, before, FcmdLog.bytes());
+		}
+		return (applied) ? _batch.size() : ERR_BATCH_REJECTED;
+	}
+
+	/**
+	 * @brief find a variable by its numeric id or by its path
+	 * the numeric id is the depth-first position within the user's tree only (SYSTEM is skipped), so it
+	 * does not shift when the library's own entries or the publishing intervals change
+	 */
+	Tdescr *findVarByKey(const char *_key)
+	{
+		const char *c = _key;
+		while (isdigit(*c))
+			c++;
+		if (c == _key || *c != '\0')
+			return findVar(_key);
+		size_t id = strtoul(_key, nullptr, 10);
+		if (id >= FsystemIds.Ffirst)
+			id += FsystemIds.Fend - FsystemIds.Ffirst;
+		return (id < FdescrIndex.size()) ? FdescrIndex[id].Fdescr : nullptr;
+	}
+
+	/**
+	 * @brief Particle.function sddsCbor
+	 * same as sddsBatch but the assignments are a base64 encoded CBOR map of variable paths or numeric ids
+	 * (position in the depth-first order of the user's tree without SYSTEM, see getSdds) to typed values: {"led.onTime_ms": 200, "5": true}
+	 * or an array of [key, value] pairs: [[5, true], ["led.onTime_ms", 200]]
+	 * @note numeric/boolean values are assigned directly, text values are parsed like in sddsBatch
+	 * @return the number of assignments applied, ERR_BATCH_REJECTED if any of them was invalid, ERR_DECODE if
+	 * the argument could not be decoded
+	 */
+	int executeCbor(String _cmd)
+	{
+		sdds_profile(COMMAND);
+		system_tick_t timestamp = millis();
+		if (_cmd.length() == 0)
+			return (ERR_NO_CMD);
+		Variant cmds;
+		if (!TparticleSerializer::base64ToVariant(_cmd, cmds) || !(cmds.isMap() || cmds.isArray()))
+		{
+			FcmdLog.add(timestamp, _cmd.c_str(), _cmd.length(), ERR_DECODE);
+			return (ERR_DECODE);
+		}
+
+		// the batch refers to the key and value texts, keep them for its lifetime
+		size_t n = cmds.size();
+		std::vector<String> texts;
+		texts.reserve(2 * n);
+		TcommandBatch batch;
+		batch.reserve(n);
+		for (size_t i = 0; i < n; ++i)
+		{
+			Variant key, value;
+			if (cmds.isMap())
+			{
+				key = cmds.asMap().keyAt(i);
+				value = cmds.asMap().valueAt(i);
+			}
+			else if (cmds.at(i).isArray() && cmds.at(i).size() == 2)
+			{
+				key = cmds.at(i).at(0);
+				value = cmds.at(i).at(1);
+			}
+			texts.push_back(key.toString());
+			const String &label = texts.back();
+			Tdescr *var = findVarByKey(label.c_str());
+			if (value.isString())
+			{
+				texts.push_back(value.toString());
+				batch.add(label.c_str(), label.length(), var, texts.back().c_str());
+			}
+			else
+				batch.add(label.c_str(), label.length(), var, value);
+		}
+		return runBatch(batch, timestamp);
+	}
+
 	/**
 	 * @brief Particle.function sendSdds
 	 */
 	int publishTree(String _cmd)
 	{
-		Variant tree = TparticleSerializer::serializeParticleTree(Froot);
+		sdds_profile(PUBLISH_REQUEST);
+		TheapAccount::Tscope heap(particleSystem().heapAccount(), TheapAccount::SERIALIZER);
+		Variant tree = TparticleSerializer::serializeParticleTree(FdescrIndex);
+		heap.measure();
 		if (!Fpublisher.queueData(tree))
 			// the structure is too large to publish, must use Particle.variable sddsGetTree instead
 			return ERR_EVENT_SIZE_MAX;
@@ -1872,8 +3321,11 @@ private:
 	 */
 	String getTree()
 	{
-		Variant tree = TparticleSerializer::serializeParticleTree(Froot);
-		return FvarResp.queue(tree.toJSON());
+		TheapAccount::Tscope heap(particleSystem().heapAccount(), TheapAccount::SERIALIZER);
+		Variant tree = TparticleSerializer::serializeParticleTree(FdescrIndex);
+		String json = tree.toJSON();
+		heap.measure();
+		return FvarResp.queue(std::move(json));
 	}
 
 	/**
@@ -1881,7 +3333,10 @@ private:
 	 */
 	int publishValues(String _cmd)
 	{
-		Variant values = TparticleSerializer::serializeParticleValues(Froot);
+		sdds_profile(PUBLISH_REQUEST);
+		TheapAccount::Tscope heap(particleSystem().heapAccount(), TheapAccount::SERIALIZER);
+		Variant values = TparticleSerializer::serializeParticleValues(FdescrIndex);
+		heap.measure();
 		if (!Fpublisher.queueData(values))
 			// the values are too large to publish, must use sddsGetValues instead
 			return ERR_EVENT_SIZE_MAX;
@@ -1895,8 +3350,11 @@ private:
 	 */
 	String getValues()
 	{
-		Variant values = TparticleSerializer::serializeParticleValues(Froot);
-		return FvarResp.queue(values.toJSON());
+		TheapAccount::Tscope heap(particleSystem().heapAccount(), TheapAccount::SERIALIZER);
+		Variant values = TparticleSerializer::serializeParticleValues(FdescrIndex);
+		String json = values.toJSON();
+		heap.measure();
+		return FvarResp.queue(std::move(json));
 	}
 
 	/**
@@ -1904,7 +3362,10 @@ private:
 	 */
 	int publishState(String _cmd)
 	{
-		Variant state = TparticleSerializer::serializeParticleState(Froot);
+		sdds_profile(PUBLISH_REQUEST);
+		TheapAccount::Tscope heap(particleSystem().heapAccount(), TheapAccount::SERIALIZER);
+		Variant state = TparticleSerializer::serializeParticleState(FdescrIndex);
+		heap.measure();
 		if (!Fpublisher.queueData(state))
 			// the state is oo large to publish, must use sddsGetValues instead
 			return ERR_EVENT_SIZE_MAX;
@@ -1913,14 +3374,190 @@ private:
 		return 0;
 	}
 
+	// command event (see subscribeCommands)
+	const static size_t CMD_EVENT_MAX_SIZE = 16 * 1024;		  // max size of a reassembled batch
+	const static system_tick_t CMD_EVENT_TIMEOUT_MS = 30000; // max time between chunks
+	String FcmdEventId;
+	dtypes::uint16 FcmdEventNext = 0; // next expected chunk (0 = no batch in progress)
+	dtypes::uint16 FcmdEventTotal = 0;
+	system_tick_t FcmdEventLast = 0;
+	String FcmdEventBuffer;
+	String FcmdEventDoneId; // id of the last completed batch (redelivered chunks are ignored)
+
+	/**
+	 * @brief Particle.subscribe handler for the command event
+	 * data format: "<id> <chunk>/<total> <commands>" (chunks numbered from 1), the commands of all chunks are
+	 * concatenated (chunks can be split anywhere) and run as one sddsBatch once the last chunk arrived
+	 * the result (or ERR_CHUNK if chunks are missing/out of order/too large) is acknowledged with a single publish
+	 * @note exactly one space separates the header from the commands, any further whitespace is part of the commands
+	 * @note chunks that were already received (same id and chunk number, e.g. redelivered events) are ignored
+	 */
+	void handleCommandEvent(const char *_event, const char *_data)
+	{
+		sdds_profile(COMMAND);
+		// header
+		const char *idEnd = strchr(_data, ' ');
+		unsigned chunk = 0, total = 0;
+		int headerLength = 0;
+		if (!idEnd || !isdigit(idEnd[1]) || sscanf(idEnd + 1, "%u/%u%n", &chunk, &total, &headerLength) != 2 ||
+			idEnd[1 + headerLength] != ' ' || chunk < 1 || chunk > total)
+		{
+			Log.error("invalid command event: %s", _data);
+			return;
+		}
+		String id(_data, idEnd - _data);
+		const char *commands = idEnd + 1 + headerLength + 1; // skip only the one separating space
+
+		// already received? (redelivered event)
+		if ((FcmdEventNext > 0 && id == FcmdEventId && total == FcmdEventTotal && chunk < FcmdEventNext) || (FcmdEventDoneId.length() > 0 && id == FcmdEventDoneId))
+		{
+			Log.trace("command event %s: ignoring repeated chunk %u/%u", id.c_str(), chunk, total);
+			return;
+		}
+
+		// first chunk starts a new batch (discards any unfinished one)
+		if (chunk == 1)
+		{
+			if (FcmdEventNext > 0)
+				Log.warn("discarding unfinished command event %s", FcmdEventId.c_str());
+			FcmdEventId = id;
+			FcmdEventTotal = total;
+			FcmdEventNext = 1;
+			FcmdEventBuffer = "";
+		}
+
+		// continuing the batch?
+		bool timedOut = millis() - FcmdEventLast > CMD_EVENT_TIMEOUT_MS;
+		if (FcmdEventNext != chunk || FcmdEventId != id || FcmdEventTotal != total || (chunk > 1 && timedOut) ||
+			FcmdEventBuffer.length() + strlen(commands) > CMD_EVENT_MAX_SIZE)
+		{
+			Log.error("command event %s: chunk %u/%u out of sequence, timed out or too large", id.c_str(), chunk, total);
+			FcmdEventNext = 0;
+			FcmdEventBuffer = "";
+			Fpublisher.queueData(TparticleSerializer::serializeCommandAck(id, ERR_CHUNK));
+			return;
+		}
+		FcmdEventBuffer += commands;
+		FcmdEventLast = millis();
+		FcmdEventNext++;
+
+		// complete?
+		if (chunk == total)
+		{
+			int result = executeBatch(FcmdEventBuffer);
+			FcmdEventNext = 0;
+			FcmdEventBuffer = "";
+			FcmdEventDoneId = id;
+			Fpublisher.queueData(TparticleSerializer::serializeCommandAck(id, result));
+		}
+	}
+
+	/**
+	 * @brief find the sdds var at the provided path (segments separated by '.') via the path table of the flat index
+	 * @return nullptr if there is no such var
+	 */
+	Tdescr *findVar(const char *_path)
+	{
+		size_t id = FdescrIndex.find(_path);
+		return (id != TdescrIndex::NONE) ? FdescrIndex[id].Fdescr : nullptr;
+	}
+
+	/**
+	 * @brief Particle.function sddsIntervals
+	 * sets the publishing interval of all variables matching path patterns
+	 * format: pattern=interval [pattern=interval ...], e.g. "adc*.voltage=5000 pump.**=-1"
+	 * @note rules are applied in order in a single pass, if several match a variable the last one wins
+	 * @return the number of variables whose interval was set
+	 */
+	int setIntervals(String _cmd)
+	{
+		system_tick_t timestamp = millis();
+		std::vector<TintervalDefault> rules;
+		int start = 0;
+		while (start < (int)_cmd.length())
+		{
+			int end = _cmd.indexOf(' ', start);
+			if (end < 0)
+				end = _cmd.length();
+			if (end > start)
+			{
+				String rule = _cmd.substring(start, end);
+				int eq = rule.lastIndexOf('=');
+				bool valid = (eq > 0 && eq < (int)rule.length() - 1);
+				for (int i = eq + 1; valid && i < (int)rule.length(); ++i)
+					valid = isdigit(rule[i]) || (i == eq + 1 && rule[i] == '-');
+				if (!valid)
+				{
+					logCommand(timestamp, rule, ERR_RULE_FORMAT);
+					return (ERR_RULE_FORMAT);
+				}
+				rules.push_back(TintervalDefault(rule.substring(eq + 1).toInt(), rule.substring(0, eq).c_str()));
+			}
+			start = end + 1;
+		}
+		if (rules.empty())
+			return (ERR_NO_CMD);
+		int count = applyIntervalDefaults(rules);
+		logCommand(timestamp, _cmd, 0);
+		return count;
+	}
+
+	/**
+	 * @brief Particle.function sddsHistory
+	 * selects which variable (and how many seconds back, all if omitted) getSddsHistory returns
+	 * format: path [seconds]
+	 * @return the number of seconds of history available
+	 */
+	int selectHistory(String _cmd)
+	{
+		int space = _cmd.indexOf(' ');
+		String path = (space < 0) ? _cmd : _cmd.substring(0, space);
+		if (path.length() == 0)
+			return (ERR_NO_CMD);
+		Tdescr *var = findVar(path.c_str());
+		TparticleVarInterval *pvi = (var) ? findVarInterval(var) : nullptr;
+		TvarHistory *history = (pvi && pvi->wrapper()) ? pvi->wrapper()->history() : nullptr;
+		if (!history)
+			return (ERR_NO_HISTORY);
+		FhistoryVar = var;
+		FhistorySeconds = (space < 0) ? 0 : _cmd.substring(space + 1).toInt();
+		// how far back does the history go?
+		if (!Time.isValid())
+			return 0;
+		time32_t oldest = history->raw().size() > 0 ? history->raw().at(0).Ftime : Time.now();
+		if (history->aggregates(TvarHistory::MINUTES).size() > 0)
+			oldest = min(oldest, history->aggregates(TvarHistory::MINUTES).at(0).Ftime);
+		if (history->aggregates(TvarHistory::HOURS).size() > 0)
+			oldest = min(oldest, history->aggregates(TvarHistory::HOURS).at(0).Ftime);
+		return Time.now() - oldest;
+	}
+
+	/**
+	 * @brief Particle.variable getSddsHistory
+	 */
+	String getHistory()
+	{
+		TparticleVarInterval *pvi = (FhistoryVar) ? findVarInterval(FhistoryVar) : nullptr;
+		TvarHistory *history = (pvi && pvi->wrapper()) ? pvi->wrapper()->history() : nullptr;
+		if (!history)
+			return "";
+		time32_t from = (FhistorySeconds > 0 && Time.isValid()) ? Time.now() - FhistorySeconds : 0;
+		// streamed through the response channels one entry at a time
+		return FvarResp.queue(new ThistoryResponse(FhistoryVar, history, from));
+	}
+
 	/**
 	 * @brief Particle.variable getSddsSystem
 	 */
 	String getSystem()
 	{
 		// serialize the SYSTEM submenu except for the individual variable interval
-		Variant system = TparticleSerializer::serializeValues(particleSystem(), true, -1, true, &sddsParticleVariables);
-		return system.toJSON();
+		// (with the vitals and diagnostics it no longer fits into a single variable value --> response channels)
+		TheapAccount::Tscope heap(particleSystem().heapAccount(), TheapAccount::SERIALIZER);
+		Variant system = TparticleSerializer::serializeValues(FdescrIndex, FdescrIndex.subtree(&particleSystem()), true, -1, true, &sddsParticleVariables);
+		String json = system.toJSON();
+		heap.measure();
+		return FvarResp.queue(std::move(json));
 	}
 
 #pragma endregion
@@ -2051,24 +3688,22 @@ public:
 		on(sdds::setup())
 		{
 
+			// bursts spilled to flash before the restart?
+			Fpublisher.checkSpill();
+
 			// initialize state stream
 			sdds::paramSave::Tstream::INIT();
+			particleSystem().markBootPhase(TparticleSystem::BOOT_STATE_INIT);
 
 			// resetting or loading state?
 			(FresetState) ? particleSystem().saveState(true) : particleSystem().loadState();
 
-			// mark startup complete now that state is loaded
-			particleSystem().startup = TparticleSystem::TstartupStatus::complete;
-
-			// publish startup info (will publish no matter what if these vars are set to ALWAYS)
-			publishVariable(&particleSystem().vitals.lastRestart);
-			publishVariable(&particleSystem().state.status);
-
-			// publish state if we're publishing and autosend on startup is on
-			if (particleSystem().publishing.record == TonOff::ON && particleSystem().state.autoSendOnStartup == TonOff::ON)
-			{
-				publishState("");
-			}
+			// startup is complete once the state is loaded (the journal may load part of it in the background)
+			if (particleSystem().loadingState())
+				particleSystem().FonStateLoaded = [this]()
+				{ completeStartup(); };
+			else
+				completeStartup();
 		};
 
 // debug actions
@@ -2078,13 +3713,13 @@ public:
 			if (particleSystem().debug == TparticleSystem::TdebugAction::getValues)
 			{
 				Log.trace("*** VALUES ***");
-				Log.print(TparticleSerializer::serializeParticleValues(Froot).toJSON().c_str());
+				Log.print(TparticleSerializer::serializeParticleValues(FdescrIndex).toJSON().c_str());
 				Log.print("\n");
 			}
 			else if (particleSystem().debug == TparticleSystem::TdebugAction::getTree)
 			{
 				Log.trace("*** TREE ***");
-				Variant tree = TparticleSerializer::serializeParticleTree(Froot);
+				Variant tree = TparticleSerializer::serializeParticleTree(FdescrIndex);
 				Log.print(tree.toJSON().c_str());
 				Log.print("\n");
 				// String base64 = TvariantSerializer::variantToBase64(FstructVar);
@@ -2104,11 +3739,33 @@ public:
 					{{publish::EACH, sdds::opt::saveval},
 					 {publish::AVG_GLOBAL, {sdds::Ttype::FLOAT32, sdds::Ttype::FLOAT64}}});
 			}
+			else if (particleSystem().debug == TparticleSystem::TdebugAction::getHeap)
+			{
+				Log.trace("*** HEAP (bytes/allocations/high-water per subsystem, %lu bytes free) ***", static_cast<unsigned long>(System.freeMemory()));
+				Log.print(particleSystem().heapAccount().toString().c_str());
+				Log.print("\n");
+			}
+			else if (particleSystem().debug == TparticleSystem::TdebugAction::testBatch)
+			{
+				Log.trace("*** BATCH CHECKS ***");
+				Log.trace("%u failed", static_cast<unsigned>(TcommandBatch::selfTest()));
+			}
+			else if (particleSystem().debug == TparticleSystem::TdebugAction::getPerf)
+			{
+				Log.trace("*** PERF (count/total ms/max us per handler) ***");
+#ifdef SDDS_PARTICLE_PROFILE
+				Log.print(particleSystem().profile().toString().c_str());
+				Log.print("\n");
+				Log.trace("longest watchdog gap: %lu ms", static_cast<unsigned long>(particleSystem().profile().watchdogGapMax()));
+#else
+				Log.trace("not available, compile with SDDS_PARTICLE_PROFILE");
+#endif
+			}
 			if (particleSystem().debug == TparticleSystem::TdebugAction::getCommandLog ||
 				particleSystem().debug == TparticleSystem::TdebugAction::setVars)
 			{
 				Log.trace("*** CMD LOG ***");
-				Log.print(FcmdLog);
+				Log.print(FcmdLog.toJSON().c_str());
 				Log.print("\n");
 			}
 			if (particleSystem().debug != TparticleSystem::TdebugAction::___)
@@ -2135,23 +3792,45 @@ public:
 	void setup(const std::vector<TintervalDefault> &_defaults = {})
 	{
 		// add SYSTEM menu
+		particleSystem().markBootPhase(TparticleSystem::BOOT_SETUP);
 		Froot->addDescr(&particleSystem(), 0);
 
+		// staged responses to low memory
+		particleSystem().FonMemoryPressure = [this](TparticleSystem::TmemoryStage::e _stage)
+		{ relieveMemory(_stage); };
+
 		// generate publishing intervals tree for all variables
 		createVariableIntervalsTree(Froot);
+		particleSystem().markBootPhase(TparticleSystem::BOOT_INTERVALS_TREE);
+
+		// flat index of the complete tree (including SYSTEM and the publishing intervals)
+		FdescrIndex.build(Froot);
+		size_t systemId = FdescrIndex.idOf(&particleSystem());
+		FsystemIds = {systemId, FdescrIndex[systemId].Fend};
 
 		// set default defaults
-		setupDefaults(
-			{// --> device EEPROM status change should always be reported
-			 {publish::ALWAYS, &particleSystem().state.status},
-			 // --> device restart should be always published
-			 {publish::ALWAYS, &particleSystem().vitals.lastRestart}});
+		std::vector<TintervalDefault> systemDefaults = {
+			// --> device EEPROM status change should always be reported
+			{publish::ALWAYS, &particleSystem().state.status},
+			// --> device restart should be always published
+			{publish::ALWAYS, &particleSystem().vitals.lastRestart}};
+		// --> startup profile is published once when it's complete
+		for (auto it = particleSystem().startupPhases_ms.iterator(); it.hasCurrent(); it.jumpToNext())
+			systemDefaults.push_back({publish::ALWAYS, it.current()});
+		setupDefaults(systemDefaults);
 
 		// set defaults
 		setupDefaults(_defaults);
+		particleSystem().markBootPhase(TparticleSystem::BOOT_DEFAULTS);
 
 		// process device reset information
 		System.enableFeature(FEATURE_RESET_INFO);
+		System.enableFeature(FEATURE_RETAINED_MEMORY);
+#ifdef SDDS_PARTICLE_CRASH_RING
+		bool crashRingValid = crashRing().setup();
+#else
+		bool crashRingValid = false;
+#endif
 		if (System.resetReason() == RESET_REASON_PANIC)
 		{
 			// uh oh - reset due to PANIC (e.g. segfault)
@@ -2159,6 +3838,7 @@ public:
 			uint32_t panicCode = System.resetReasonData();
 			Log.error("restarted due to PANIC, code: %lu", panicCode);
 			particleSystem().vitals.lastRestart = TparticleSystem::TrestartStatus::PANIC;
+			FrecoverCrash = crashRingValid;
 			// System.enterSafeMode(); // go straight to safe mode?
 		}
 		else if (System.resetReason() == RESET_REASON_WATCHDOG)
@@ -2166,6 +3846,7 @@ public:
 			// hardware watchdog detected a timeout
 			Log.warn("restarted due to watchdog (=timeout)");
 			particleSystem().vitals.lastRestart = TparticleSystem::TrestartStatus::watchdogTimeout;
+			FrecoverCrash = crashRingValid;
 		}
 		else if (System.resetReason() == RESET_REASON_USER)
 		{
@@ -2176,6 +3857,7 @@ public:
 				// low memory detected
 				Log.warn("restarted due to low memory");
 				particleSystem().vitals.lastRestart = TparticleSystem::TrestartStatus::outOfMemory;
+				FrecoverCrash = crashRingValid;
 			}
 			else if (userReset == static_cast<uint8_t>(TparticleSystem::TrestartStatus::userRestart))
 			{
@@ -2197,6 +3879,12 @@ public:
 			// https://docs.particle.io/reference/cloud-apis/api/#spark-device-last_reset
 		}
 
+#ifdef SDDS_PARTICLE_CRASH_RING
+		// nothing to recover from a regular restart
+		if (!FrecoverCrash)
+			crashRing().clear();
+#endif
+
 // DEBUG option: force state reset
 #ifdef SDDS_PARTICLE_RESET
 		resetState = true;
@@ -2205,12 +3893,20 @@ public:
 		// main particle functions to interact with the the self-describing data-structure
 		Particle.function("sdds", &TparticleSpike::setVariables, this);
 
+		// atomic version of sdds for larger batches of assignments (optional, function slots are limited)
+#ifdef SDDS_PARTICLE_BATCH
+		Particle.function("sddsBatch", &TparticleSpike::executeBatch, this);
+#endif
+#ifdef SDDS_PARTICLE_CBOR
+		Particle.function("sddsCbor", &TparticleSpike::executeCbor, this);
+#endif
+
 		// particle functions to publish tree, values, and state to event stream (also possible via sdds "SYSTEM.action=sendSdds/sendSddsValues/sendSddsState")
 		Particle.function("sendSdds", &TparticleSpike::publishTree, this);
 		Particle.function("sendSddsValues", &TparticleSpike::publishValues, this);
 		Particle.function("sendSddsState", &TparticleSpike::publishState, this);
 
-		// get SDDS sytem tree (minus the variable publish intervas), i.e. just the core tree which is small enough to fit into 1kB variable
+		// get SDDS sytem tree (minus the variable publish intervas), i.e. just the core tree (split across the return value channels like getSdds)
 		Particle.variable("getSddsSystem", [this]()
 						  { return this->getSystem(); });
 
@@ -2222,7 +3918,55 @@ public:
 		FvarResp.registerChannels(); // return value channels
 
 		// convenience particle variable to get the command log
-		Particle.variable("getSddsCommandLog", FcmdLog);
+		Particle.variable("getSddsCommandLog", [this]()
+						  { return this->FcmdLog.toJSON(); });
+
+		// on-device history of individual variables (optional, see enableHistory)
+#ifdef SDDS_PARTICLE_HISTORY
+		Particle.function("sddsHistory", &TparticleSpike::selectHistory, this);
+		Particle.variable("getSddsHistory", [this]()
+						  { return this->getHistory(); });
+#endif
+
+		// set publishing intervals by path patterns (optional, the setup() defaults support patterns either way)
+#ifdef SDDS_PARTICLE_INTERVALS
+		Particle.function("sddsIntervals", &TparticleSpike::setIntervals, this);
+#endif
+	}
+
+	/**
+	 * @brief publish a specific variable explicitly (its current value, or the values collected
+	 * so far if it is averaged), e.g. particleSpike.publishNow(&sddsTree.adc1.voltage)
+	 * @note call after setup(), uses the origin index (no tree walk)
+	 * @return false if _var is not part of the sdds tree or its type cannot be published
+	 */
+	bool publishNow(Tdescr *_var)
+	{
+		return publishVariable(_var);
+	}
+
+	/**
+	 * @brief keep an on-device history of a numeric variable (raw values plus 1-minute and 1-hour
+	 * aggregates) that can be retrieved via the sddsHistory function and getSddsHistory variable
+	 * @note call after setup(), the history is kept in RAM so size the config accordingly
+	 * @return whether the history could be enabled
+	 */
+	bool enableHistory(Tdescr *_var, const ThistoryConfig &_config = ThistoryConfig())
+	{
+		TparticleVarInterval *pvi = findVarInterval(_var);
+		return (pvi) ? pvi->enableHistory(_config) : false;
+	}
+
+	/**
+	 * @brief accept (chunked) command batches via a device-scoped cloud event "sddsCommands/<deviceID>"
+	 * instead of just the function call argument, results are acknowledged on the data event
+	 * @note optional, call during setup() (after particleSpike.setup())
+	 * @return whether the subscription succeeded
+	 */
+	bool subscribeCommands()
+	{
+		String event = String("sddsCommands/") + Particle.deviceID();
+		return Particle.subscribe(event.c_str(), &TparticleSpike::handleCommandEvent, this);
 	}
 
 #pragma endregion
@@ -4,7 +4,30 @@
 #include "uTypedef.h"
 #include "uCoreEnums.h"
 #include "uParamSave.h"
+#ifdef SDDS_PARTICLE_STATE_JOURNAL
+#include "uStateJournal.h"
+#endif
+#include "uHeapAccount.h"
+#ifdef SDDS_PARTICLE_CRASH_RING
+#include "uCrashRing.h"
+#endif
+#ifdef SDDS_PARTICLE_PROFILE
+#include "uLoopProfile.h"
+#endif
+
+class TparticleSystem;
+TparticleSystem &particleSystem();
+
+// profile the enclosing scope as one run of a handler (no-op unless compiled with SDDS_PARTICLE_PROFILE)
+#ifdef SDDS_PARTICLE_PROFILE
+#define sdds_profile(_handler) TloopProfile::Tscope profileScope(particleSystem().profile(), TloopProfile::_handler)
+#else
+#define sdds_profile(_handler)
+#endif
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
 
 // always use system threading to avoid particle cloud synchronization to block the app
 #ifndef SYSTEM_VERSION_v620
@@ -49,6 +72,24 @@ public:
     sdds_enum(___, complete) TstartupStatus;
     sdds_var(TstartupStatus, startup, sdds::opt::readonly); // keeps track of startup processes
 
+    // when each startup phase was reached (ms since boot, 0 = not reached), see TbootPhase
+    class TstartupPhases : public TmenuHandle
+    {
+    public:
+        sdds_var(Tuint32, setup, sdds::opt::readonly);    // spike setup() started
+        sdds_var(Tuint32, tree, sdds::opt::readonly);     // publishing intervals tree created
+        sdds_var(Tuint32, defaults, sdds::opt::readonly); // interval defaults applied
+        sdds_var(Tuint32, system, sdds::opt::readonly);   // system setup started
+        sdds_var(Tuint32, connect, sdds::opt::readonly);  // Particle.connect() called
+        sdds_var(Tuint32, init, sdds::opt::readonly);     // paramSave stream initialized
+        sdds_var(Tuint32, load, sdds::opt::readonly);     // state loaded (or reset)
+        sdds_var(Tuint32, complete, sdds::opt::readonly); // startup complete
+        sdds_var(Tuint32, cloud, sdds::opt::readonly);    // cloud connected
+        sdds_var(Tuint32, time, sdds::opt::readonly);     // valid time
+        sdds_var(Tuint32, name, sdds::opt::readonly);     // device name received
+    };
+    sdds_var(TstartupPhases, startupPhases_ms);
+
     sdds_enum(connecting, connected, disconnected) TinternetStatus;
     sdds_var(TinternetStatus, internet, sdds::opt::readonly, TinternetStatus::connecting); // internet status
 
@@ -59,6 +100,9 @@ public:
         sdds_enum(normal, reset, failedLoad, failedSave) Tstatus;
         sdds_var(Tstatus, status, sdds::opt::readonly);
         sdds_var(TonOff, autoSendOnStartup, sdds::opt::saveval, TonOff::ON); // auto-send on startup if publishing is on
+        sdds_var(TonOff, autoSave, 0, TonOff::OFF);                           // save automatically when saveable variables change (settings file)
+        sdds_var(Tuint16, autoSaveDelay_sec, 0, 10);                          // quiet period after the last change before the autosave (settings file)
+        sdds_var(TonOff, pending, sdds::opt::readonly, TonOff::OFF);          // are there changes that are not saved yet?
         sdds_var(Tstring, lastSave_dt, sdds_joinOpt(sdds::opt::saveval, sdds::opt::readonly), "never");
         sdds_var(Tuint16, size_byte, sdds::opt::readonly);
         sdds_var(TparamError, error, sdds::opt::readonly);
@@ -67,8 +111,20 @@ public:
 
     // vitals variables
     sdds_enum(powerUp, userRestart, userReset, watchdogTimeout, outOfMemory, PANIC) TrestartStatus;
+    sdds_enum(none, releaseChannels, spillBursts, mergeBursts, pauseEach) TmemoryStage;
     class Tvitals : public TmenuHandle
     {
+        // heap high-water marks per subsystem (in bytes)
+        class Theap : public TmenuHandle
+        {
+        public:
+            sdds_var(Tuint32, serializer_byte, sdds::opt::readonly); // serialized trees/values/state/logs
+            sdds_var(Tuint32, burst_byte, sdds::opt::readonly);      // current burst data
+            sdds_var(Tuint32, queue_byte, sdds::opt::readonly);      // queued and in-flight bursts
+            sdds_var(Tuint32, commandLog_byte, sdds::opt::readonly); // command log
+            sdds_var(Tuint32, response_byte, sdds::opt::readonly);   // variable response channels
+        };
+
     public:
         sdds_var(Tuint32, publishVitals_sec, sdds::opt::saveval, 60 * 60 * 6);               // how often to publish device vitals in seconds (takes 150 bytes per transmission!), 0 = no regular publishing
         sdds_var(Tstring, time_dt, sdds::opt::readonly);                                     // system time
@@ -76,6 +132,8 @@ public:
         sdds_var(Tstring, network, sdds::opt::readonly);                                     // wifi network - can get this from device vitals
         sdds_var(Tuint8, signal_percent, sdds::opt::readonly);                               // wifi signal strength - can get this from device vitals
         sdds_var(TrestartStatus, lastRestart, sdds::opt::readonly, TrestartStatus::powerUp); // restart information
+        sdds_var(Tuint16, checkSignal_sec, 0, 60);                                           // how often to check the signal strength and network in seconds (settings file)
+        sdds_var(Tuint32, monitorMax_us, sdds::opt::readonly);                               // max cost of a system monitor tick (in the last memory check interval)
 
 // random access memory (RAM, in bytes)
 #if (PLATFORM_ID == PLATFORM_ARGON || PLATFORM_ID == PLATFORM_BORON)
@@ -86,6 +144,12 @@ public:
         sdds_var(Tuint32, totalRAM_byte, sdds::opt::readonly, 0);
 #endif
         sdds_var(Tuint32, freeRAM_byte, sdds::opt::readonly); // free memory information
+        sdds_var(Theap, heapMax);                             // heap high-water marks per subsystem
+
+        // memory pressure (stages engage at evenly spaced thresholds between memoryPressure_byte and the restart limit)
+        sdds_var(Tuint32, memoryPressure_byte, 0, 0);                         // free RAM below which memory is freed up in stages, 0 = all stages at once at the restart limit (settings file)
+        sdds_var(TmemoryStage, memoryStage, sdds::opt::readonly);             // current stage
+        sdds_var(TmemoryStage, memoryStageMax, sdds::opt::readonly);          // highest stage reached since the restart
 
         // flash memory (in bytes) / number of sectors
         inline static const size_t FflashSectorSize_byte = 4 * 1024; // 4 KB
@@ -125,6 +189,7 @@ public:
             sdds_var(Tuint32, failed, sdds::opt::readonly, 0);     // number of failed/requeued bursts
             sdds_var(Tuint32, invalid, sdds::opt::readonly, 0);    // number of invalid/discarded bursts
             sdds_var(Tuint32, discarded, sdds::opt::readonly, 0);  // number of invalid/discarded bursts
+            sdds_var(Tuint32, spilled, sdds::opt::readonly, 0);    // number of bursts spilled to flash (memory pressure)
         };
 
     public:
@@ -136,9 +201,24 @@ public:
     };
     sdds_var(Tpublishing, publishing);
 
+// event loop profile
+#ifdef SDDS_PARTICLE_PROFILE
+    class Tperf : public TmenuHandle
+    {
+    public:
+        sdds_enum(___, update, reset) Taction;
+        sdds_var(Taction, action);                               // update the handler statistics or reset them
+        sdds_var(Tuint32, watchdogGapMax_ms, sdds::opt::readonly); // longest time between watchdog refreshes
+        sdds_var(Tstring, slowest, sdds::opt::readonly);           // handler with the longest single run
+        sdds_var(Tuint32, slowestMax_us, sdds::opt::readonly);     // its longest run
+        sdds_var(Tstring, handlers, sdds::opt::readonly);          // name:count/total_ms/max_us of each handler that ran
+    };
+    sdds_var(Tperf, perf);
+#endif
+
 // debug tools
 #ifdef SDDS_PARTICLE_DEBUG
-    sdds_enum(___, getValues, getTree, getCommandLog, setVars, setDefaults) TdebugAction;
+    sdds_enum(___, getValues, getTree, getCommandLog, setVars, setDefaults, getPerf, getHeap, testBatch) TdebugAction;
 sdds_var(TdebugAction, debug)  // debug actions
     sdds_var(Tstring, command) // debug actions
 #endif
@@ -154,10 +234,93 @@ sdds_var(TdebugAction, debug)  // debug actions
     // how much free RAM (in bytes) required before forced restart?
     const uint32_t memoryRestartLimit = 5 * 1024; // limit to 5 KB
 
-    // platform check-in timer
-    const system_tick_t FcheckInterval = 100; // ms
+    TmemoryStage::e FmemoryStage = TmemoryStage::none;
+    TmemoryStage::e FmemoryStageMax = TmemoryStage::none;
+
+    /**
+     * @brief the memory stage for the current amount of free RAM
+     */
+    TmemoryStage::e memoryStageFor(uint32_t _freeRAM)
+    {
+        if (_freeRAM < memoryRestartLimit)
+            return TmemoryStage::pauseEach;
+        if (vitals.memoryPressure_byte <= memoryRestartLimit || _freeRAM >= vitals.memoryPressure_byte)
+            return TmemoryStage::none;
+        uint32_t step = (vitals.memoryPressure_byte - memoryRestartLimit) / TmemoryStage::pauseEach + 1;
+        uint32_t stage = 1 + (vitals.memoryPressure_byte - _freeRAM) / step;
+        return static_cast<TmemoryStage::e>(std::min<uint32_t>(stage, TmemoryStage::pauseEach));
+    }
+
+    /**
+     * @brief free up memory in stages before resorting to a restart
+     */
+    void handleMemoryPressure(uint32_t _freeRAM)
+    {
+        TmemoryStage::e current = FmemoryStage;
+        TmemoryStage::e target = memoryStageFor(_freeRAM);
+
+        // recovered
+        if (target == TmemoryStage::none)
+        {
+            if (current != TmemoryStage::none)
+            {
+                Log.info("memory recovered (%lu bytes free)", static_cast<unsigned long>(_freeRAM));
+                FmemoryStage = TmemoryStage::none;
+                vitals.memoryStage = TmemoryStage::none;
+                if (FonMemoryPressure)
+                    FonMemoryPressure(TmemoryStage::none);
+            }
+            return;
+        }
+
+        // all stages were already applied and it's still not enough
+        if (_freeRAM < memoryRestartLimit && (current == TmemoryStage::pauseEach || !FonMemoryPressure))
+        {
+            // not enough free memory to keep operating safely
+            System.reset(static_cast<uint8_t>(TrestartStatus::outOfMemory));
+            return;
+        }
+
+        // (re)apply all stages up to the target only when it goes up: on a plateau the publisher keeps
+        // sending and restoring (stages only go back down once the memory recovered)
+        if (target <= current)
+            return;
+        Log.warn("memory pressure (%lu bytes free), stage %d", static_cast<unsigned long>(_freeRAM), static_cast<int>(target));
+        if (FonMemoryPressure)
+        {
+            for (int stage = TmemoryStage::releaseChannels; stage <= target; ++stage)
+                FonMemoryPressure(static_cast<TmemoryStage::e>(stage));
+        }
+        FmemoryStage = target;
+        vitals.memoryStage = target;
+        if (FmemoryStageMax < target)
+        {
+            FmemoryStageMax = target;
+            vitals.memoryStageMax = target;
+        }
+    }
+
+    // platform check-in timer (clock, pending cloud actions)
+    const system_tick_t FcheckInterval = 250; // ms
     Ttimer FsystemCheckTimer;
 
+    // hardware watchdog refresh (own tick so the check-in never delays it)
+    const system_tick_t FwatchdogInterval = 1000; // ms
+    Ttimer FwatchdogTimer;
+
+    // less frequent checks (done during the check-in)
+    const system_tick_t FmemoryCheckInterval = 1000; // ms
+    system_tick_t FlastMemoryCheck = 0;
+    system_tick_t FlastSignalCheck = 0;
+    dtypes::uint32 FmonitorMax_us = 0;
+
+    // cloud status (from the system event handler, applied during the check-in)
+    inline static volatile int FcloudStatus = cloud_status_connecting;
+    static void handleCloudStatus(system_event_t _event, int _status)
+    {
+        FcloudStatus = _status;
+    }
+
     // delayed action timers
     Ttimer FdelayedActionTimer;
     Taction::e FdelayedAction = Taction::___;
@@ -173,6 +336,328 @@ sdds_var(TdebugAction, debug)  // debug actions
     // time stamp for the clock update
     time32_t FlastNow = 0;
 
+    // heap accounting per subsystem
+    TheapAccount FheapAccount;
+
+#ifdef SDDS_PARTICLE_CRASH_RING
+    // keep the latest counters in retained RAM (recovered after a crash)
+    void keepCrashCounters()
+    {
+        TcrashRing::Tcounters counters{};
+        counters.Fuptime_s = millis() / 1000;
+        counters.FfreeRAM_byte = vitals.freeRAM_byte;
+        counters.FmonitorMax_us = FmonitorMax_us;
+#ifdef SDDS_PARTICLE_PROFILE
+        counters.FwatchdogGapMax_ms = Fprofile.watchdogGapMax();
+#endif
+        counters.Fqueued = publishing.bursts.queued;
+        counters.FmemoryStage = FmemoryStage;
+        crashRing().setCounters(counters);
+    }
+#endif
+
+    void updateHeapMax()
+    {
+        auto &h = vitals.heapMax;
+        if (h.serializer_byte != FheapAccount[TheapAccount::SERIALIZER].FhighWater)
+            h.serializer_byte = FheapAccount[TheapAccount::SERIALIZER].FhighWater;
+        if (h.burst_byte != FheapAccount[TheapAccount::BURST].FhighWater)
+            h.burst_byte = FheapAccount[TheapAccount::BURST].FhighWater;
+        if (h.queue_byte != FheapAccount[TheapAccount::QUEUE].FhighWater)
+            h.queue_byte = FheapAccount[TheapAccount::QUEUE].FhighWater;
+        if (h.commandLog_byte != FheapAccount[TheapAccount::COMMAND_LOG].FhighWater)
+            h.commandLog_byte = FheapAccount[TheapAccount::COMMAND_LOG].FhighWater;
+        if (h.response_byte != FheapAccount[TheapAccount::RESPONSE].FhighWater)
+            h.response_byte = FheapAccount[TheapAccount::RESPONSE].FhighWater;
+    }
+
+#ifdef SDDS_PARTICLE_PROFILE
+    // event loop profile
+    TloopProfile Fprofile;
+
+    void updatePerf()
+    {
+        TloopProfile::Thandler slowest = Fprofile.slowest();
+        perf.slowest = (Fprofile[slowest].Fmax_us > 0) ? TloopProfile::name(slowest) : "";
+        perf.slowestMax_us = Fprofile[slowest].Fmax_us;
+        perf.handlers = Fprofile.toString().c_str();
+    }
+#endif
+
+public:
+    // startup milestones (in the order they usually happen)
+    enum TbootPhase
+    {
+        BOOT_SETUP,          // spike setup() started
+        BOOT_INTERVALS_TREE, // publishing intervals tree created
+        BOOT_DEFAULTS,       // interval defaults applied
+        BOOT_SYSTEM_SETUP,   // system on(sdds::setup()) started
+        BOOT_CONNECT,        // Particle.connect() called
+        BOOT_STATE_INIT,     // paramSave stream initialized
+        BOOT_STATE_LOADED,   // state loaded (or reset)
+        BOOT_COMPLETE,       // startup complete
+        BOOT_CLOUD,          // cloud connected
+        BOOT_TIME_SYNC,      // valid time
+        BOOT_NAME,           // device name received
+        N_BOOT_PHASES
+    };
+
+private:
+    // startup phase profile
+    inline static const char *const FbootPhaseNames[N_BOOT_PHASES] = {
+        "setup", "tree", "defaults", "system", "connect", "init", "load", "complete", "cloud", "time", "name"};
+    const system_tick_t FbootProfileTimeout = 1000 * 60 * 5; // publish what's there if not all phases are reached after 5 minutes
+    system_tick_t FbootTimes[N_BOOT_PHASES] = {};
+    dtypes::uint16 FbootReached = 0; // bit per phase
+    bool FbootProfiled = false;
+
+    /**
+     * @brief once all phases are reached (or it's taking too long), store the profile in startupPhases_ms
+     */
+    void checkBootProfile()
+    {
+        if (FbootProfiled)
+            return;
+        const dtypes::uint16 all = (1 << N_BOOT_PHASES) - 1;
+        if (FbootReached != all && millis() < FbootProfileTimeout)
+            return;
+        Tuint32 *phases[N_BOOT_PHASES] = {
+            &startupPhases_ms.setup, &startupPhases_ms.tree, &startupPhases_ms.defaults, &startupPhases_ms.system,
+            &startupPhases_ms.connect, &startupPhases_ms.init, &startupPhases_ms.load, &startupPhases_ms.complete,
+            &startupPhases_ms.cloud, &startupPhases_ms.time, &startupPhases_ms.name};
+        FbootProfiled = true;
+        for (int i = 0; i < N_BOOT_PHASES; ++i)
+        {
+            if (!(FbootReached & (1 << i)))
+                continue;
+            Log.trace("startup phase %s: %lu ms", FbootPhaseNames[i], static_cast<unsigned long>(FbootTimes[i]));
+            *phases[i] = FbootTimes[i];
+        }
+    }
+
+    // autosave (debounced: saves once the saveable variables stopped changing for the quiet period)
+    const system_tick_t FautoSaveMaxWait = 1000 * 60 * 5; // save at the latest 5 minutes after the first unsaved change
+    Ttimer FautoSaveTimer;
+    system_tick_t FpendingSince = 0;
+    bool FsavingState = false; // ignore changes made by the save itself (e.g. lastSave_dt)
+
+    /**
+     * @brief watch all saveable variables of the tree for changes
+     */
+    void watchSaveableVars(TmenuHandle *_struct)
+    {
+        for (auto it = _struct->iterator(); it.hasCurrent(); it.jumpToNext())
+        {
+            Tdescr *d = it.current();
+            if (!d)
+                continue;
+            if (d->isStruct())
+            {
+                TmenuHandle *mh = static_cast<Tstruct *>(d)->value();
+                if (mh)
+                    watchSaveableVars(mh);
+            }
+            else if ((d->option() & sdds::opt::saveval) == sdds::opt::saveval)
+            {
+                d->callbacks()->addCb() = [this](void *_ctx)
+                {
+                    stateChanged();
+                };
+            }
+        }
+    }
+
+    /**
+     * @brief a saveable variable changed --> (re)start the quiet period
+     */
+    void stateChanged()
+    {
+        // changes during load/startup or by the save itself don't need saving
+        if (FsavingState || startup != TstartupStatus::complete)
+            return;
+#ifdef SDDS_PARTICLE_STATE_JOURNAL
+        if (FloadingState)
+            return;
+#endif
+        if (state.pending == TonOff::OFF)
+        {
+            state.pending = TonOff::ON;
+            FpendingSince = millis();
+        }
+        scheduleAutoSave();
+    }
+
+    void scheduleAutoSave()
+    {
+        if (state.autoSave == TonOff::OFF || state.pending == TonOff::OFF)
+            return;
+        // don't let a steady stream of changes postpone the save forever
+        if (millis() - FpendingSince >= FautoSaveMaxWait)
+            return;
+        FautoSaveTimer.stop();
+        FautoSaveTimer.start(1000 * static_cast<system_tick_t>(state.autoSaveDelay_sec));
+    }
+
+    // settings added after the layout of the parameter stream was set: they are saved together with the
+    // state but kept in their own file (one path=value per line) so that the positional parameter stream
+    // saved by earlier versions still loads
+    inline static const char *const SETTINGS_DIR = "/sdds";
+    inline static const char *const SETTINGS_FILE = "/sdds/settings";
+    inline static const char *const SETTINGS_TEMP_FILE = "/sdds/settings.tmp";
+
+    struct Tsetting
+    {
+        const char *Fpath;
+        Tdescr *Fvar;
+    };
+
+    std::vector<Tsetting> settings()
+    {
+        return {
+            {"state.autoSave", &state.autoSave},
+            {"state.autoSaveDelay_sec", &state.autoSaveDelay_sec},
+            {"vitals.checkSignal_sec", &vitals.checkSignal_sec},
+            {"vitals.memoryPressure_byte", &vitals.memoryPressure_byte}};
+    }
+
+    static int32_t settingsFileSize(const char *_path)
+    {
+        struct stat s;
+        return (stat(_path, &s) == 0) ? static_cast<int32_t>(s.st_size) : -1;
+    }
+
+    /**
+     * @brief write the settings file (via a temporary file so a failed write keeps the previous settings)
+     * @return whether the settings were saved
+     */
+    bool saveSettings()
+    {
+        String content;
+        for (auto &setting : settings())
+        {
+            content += setting.Fpath;
+            content += "=";
+            content += setting.Fvar->to_string().c_str();
+            content += "\n";
+        }
+        mkdir(SETTINGS_DIR, 0755);
+        int32_t oldBytes = settingsFileSize(SETTINGS_FILE);
+        int fd = open(SETTINGS_TEMP_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        bool ok = (write(fd, content.c_str(), content.length()) == static_cast<int>(content.length()));
+        close(fd);
+        if (!ok || rename(SETTINGS_TEMP_FILE, SETTINGS_FILE) != 0)
+        {
+            unlink(SETTINGS_TEMP_FILE);
+            return false;
+        }
+        reportFileSize(oldBytes, content.length());
+        return true;
+    }
+
+    /**
+     * @brief restore the settings from the settings file (unknown or invalid lines are skipped, missing settings keep their defaults)
+     */
+    void loadSettings()
+    {
+        int32_t size = settingsFileSize(SETTINGS_FILE);
+        if (size <= 0 || size > 1024)
+            return;
+        int fd = open(SETTINGS_FILE, O_RDONLY);
+        if (fd < 0)
+            return;
+        char buf[1025];
+        int n = read(fd, buf, size);
+        close(fd);
+        if (n <= 0)
+            return;
+        buf[n] = '\0';
+        std::vector<Tsetting> all = settings();
+        for (char *line = buf; line && *line;)
+        {
+            char *next = strchr(line, '\n');
+            if (next)
+                *next++ = '\0';
+            char *value = strchr(line, '=');
+            if (value)
+            {
+                *value++ = '\0';
+                for (auto &setting : all)
+                {
+                    if (strcmp(setting.Fpath, line) == 0)
+                    {
+                        if (strcmp(setting.Fvar->to_string().c_str(), value) != 0)
+                            setting.Fvar->setValue(value);
+                        break;
+                    }
+                }
+            }
+            line = next;
+        }
+    }
+
+#ifdef SDDS_PARTICLE_STATE_JOURNAL
+    // journaled state store (instead of the parameter stream)
+    TstateJournal FstateJournal;
+
+    void setupStateJournal()
+    {
+        if (FstateJournal.isSetup())
+            return;
+        FstateJournal.FonFileSize = [this](int32_t _oldBytes, int32_t _newBytes)
+        { reportFileSize(_oldBytes, _newBytes); };
+        FstateJournal.setup(findRoot());
+    }
+
+    // deferred loading of the rest of the state (one top level entry per step)
+    const system_tick_t FstateLoadStepInterval = 1; // ms
+    Ttimer FstateLoadTimer;
+    bool FloadingState = false;
+
+    void loadStateStep()
+    {
+        sdds_profile(LOAD_STATE);
+        FloadingState = true;
+        loadedState(FstateJournal.loadNext());
+        FloadingState = false;
+    }
+
+    void loadedState(TstateJournal::Tresult _result)
+    {
+        if (_result == TstateJournal::OK || _result == TstateJournal::NO_STATE)
+        {
+            if (state.status != Tstate::Tstatus::failedLoad)
+                state.status = Tstate::Tstatus::normal;
+            state.size_byte = std::min<size_t>(FstateJournal.size(), UINT16_MAX);
+            if (state.status == Tstate::Tstatus::normal && state.error != TparamError::___)
+                state.error = TparamError::___;
+        }
+        else if (state.status != Tstate::Tstatus::failedLoad)
+        {
+            // there was a problem!
+            state.status = Tstate::Tstatus::failedLoad;
+            state.error = TparamError::crcError;
+        }
+    }
+#endif
+
+    // flash usage (kept up to date by write deltas, corrected by regular background rescans)
+    // note: Device OS does not expose the LittleFS block usage, so it's estimated from the files
+    size_t FusedSectors = 0;
+    const system_tick_t FflashRescanInterval = 1000 * 60 * 60 * 6; // every 6 hours
+    Ttimer FflashRescanTimer;
+
+    // background rescan of the file system (a few directory entries per step)
+    const size_t FflashScanEntriesPerStep = 8;
+    const system_tick_t FflashScanStepInterval = 10; // ms
+    Ttimer FflashScanTimer;
+    std::vector<String> FscanDirs; // directories still to scan
+    DIR *FscanDir = nullptr;       // directory currently being scanned
+    String FscanPath;
+    size_t FscanSectors = 0;
+    int32_t FscanDelta = 0; // sectors reported by writes during the scan (applied once it completes)
+
 public:
     TparticleSystem()
     {
@@ -180,6 +665,8 @@ public:
         // system setup
         on(sdds::setup())
         {
+            markBootPhase(BOOT_SYSTEM_SETUP);
+
             // device should always operate in UTC (web-app will translate)
             Time.zone(0);
 
@@ -199,18 +686,33 @@ public:
             vitals.mac = buff;
 #endif
 
-            // calculate free flash memory
-            // DO NOT do this regularly, too much overhead, instead do it after writes to flash
+            // calculate free flash memory (in the background)
             checkFlashUsage();
+            FflashRescanTimer.start(FflashRescanInterval);
+
+            // autosave
+            watchSaveableVars(findRoot());
+            for (auto &setting : settings())
+            {
+                setting.Fvar->callbacks()->addCb() = [this](void *_ctx)
+                {
+                    stateChanged();
+                };
+            }
 
             // subscribe to name handler
             Particle.subscribe("particle/device/name", &TparticleSystem::captureName, this);
 
+            // cloud connection status (parentheses keep the sdds on() macro from expanding)
+            (System.on)(cloud_status, &TparticleSystem::handleCloudStatus);
+
             // connect to the cloud (ties up the system thread)
             Particle.connect();
+            markBootPhase(BOOT_CONNECT);
 
             // start system timers
             FsystemCheckTimer.start(FcheckInterval);
+            FwatchdogTimer.start(FwatchdogInterval);
             FsyncTimer.start(FtimeSyncInterval);
         };
 
@@ -285,6 +787,49 @@ public:
             }
         };
 
+        // autosave
+        on(state.autoSave)
+        {
+            if (state.autoSave == TonOff::ON)
+                scheduleAutoSave();
+            else
+                FautoSaveTimer.stop();
+        };
+        on(FautoSaveTimer)
+        {
+            if (state.autoSave == TonOff::ON && state.pending == TonOff::ON)
+                saveState();
+        };
+
+#ifdef SDDS_PARTICLE_STATE_JOURNAL
+        // deferred state loading
+        on(FstateLoadTimer)
+        {
+            loadStateStep();
+            if (FstateJournal.loading())
+                FstateLoadTimer.start(FstateLoadStepInterval);
+            else if (FonStateLoaded)
+                FonStateLoaded();
+        };
+#endif
+
+#ifdef SDDS_PARTICLE_PROFILE
+        // event loop profile
+        on(perf.action)
+        {
+            if (perf.action == Tperf::Taction::update)
+                updatePerf();
+            else if (perf.action == Tperf::Taction::reset)
+            {
+                Fprofile.reset();
+                updatePerf();
+                perf.watchdogGapMax_ms = 0;
+            }
+            if (perf.action != Tperf::Taction::___)
+                perf.action = Tperf::Taction::___;
+        };
+#endif
+
         // vitals publishing interval
         on(vitals.publishVitals_sec)
         {
@@ -294,58 +839,23 @@ public:
         // system check in
         on(FsystemCheckTimer)
         {
-            // refresh the hardware watchdog
-            Watchdog.refresh();
-
-            // check if memory changed
-            if (vitals.freeRAM_byte != System.freeMemory())
-            {
-                vitals.freeRAM_byte = System.freeMemory();
-                if (vitals.freeRAM_byte < memoryRestartLimit)
-                {
-                    // not enough free memory to keep operating safely
-                    // FIXME: should there be some sort of data dump of the queuedData first?
-                    // probably good to put it onto the flash drive
-                    System.reset(static_cast<uint8_t>(TrestartStatus::outOfMemory));
-                }
-            }
+            uint32_t start = micros();
+            sdds_profile(SYSTEM_CHECK);
 
             // check if connection status changed
-            if (internet == TinternetStatus::connecting && Particle.connected())
+            bool connected = (FcloudStatus == cloud_status_connected);
+            if (internet == TinternetStatus::connecting && connected)
             {
                 internet = TinternetStatus::connected;
+                markBootPhase(BOOT_CLOUD);
             }
-            else if (internet == TinternetStatus::connected && !Particle.connected())
+            else if (internet == TinternetStatus::connected && !connected)
             {
                 internet = TinternetStatus::connecting;
             }
 
-// check on wifi/cellular info
-#if Wiring_WiFi && Wiring_WiFi == 1
-            if (WiFi.ready() && Particle.connectionInterface() == WiFi)
-            {
-                WiFiSignal rssi = WiFi.RSSI();
-                dtypes::uint8 sig = static_cast<dtypes::uint8>(round(rssi.getStrength()));
-                if (vitals.signal_percent != sig)
-                    vitals.signal_percent = sig;
-                if (vitals.network != WiFi.SSID())
-                    vitals.network = WiFi.SSID();
-            }
-#endif
-
-#if Wiring_Cellular && Wiring_Cellular == 1
-            if (Cellular.ready() && Particle.connectionInterface() == Cellular)
-            {
-                CellularSignal rssi = Cellular.RSSI();
-                dtypes::uint8 sig = static_cast<dtypes::uint8>(round(rssi.getStrength()));
-                if (vitals.signal_percent != sig)
-                    vitals.signal_percent = sig;
-                // FIXME: what's the cellular network equivalent to SSID?
-            }
-#endif
-
             // resync system time
-            if (FresyncSysTime && Particle.connected())
+            if (FresyncSysTime && connected)
             {
                 // sync time with cloud
                 Log.trace("resynchronizing time with cloud");
@@ -358,31 +868,171 @@ public:
             // update time sdds_var
             if (Time.isValid() && Time.now() > FlastNow)
             {
+                markBootPhase(BOOT_TIME_SYNC);
                 FlastNow = Time.now();
                 vitals.time_dt = Time.format(FlastNow, TIME_FORMAT_ISO8601_FULL); //"%Y-%m-%d %H:%M:%S %Z");
             }
 
             // trigger name handler
-            if (FrequestName && Particle.connected())
+            if (FrequestName && connected)
             {
                 Particle.publish("particle/device/name");
                 FrequestName = false;
             }
 
+            // check on memory (and the startup profile)
+            if (millis() - FlastMemoryCheck >= FmemoryCheckInterval)
+            {
+                FlastMemoryCheck = millis();
+                checkMemory();
+                updateHeapMax();
+#ifdef SDDS_PARTICLE_CRASH_RING
+                keepCrashCounters();
+#endif
+                if (startup == TstartupStatus::complete)
+                    checkBootProfile();
+                if (vitals.monitorMax_us != FmonitorMax_us)
+                    vitals.monitorMax_us = FmonitorMax_us;
+#ifdef SDDS_PARTICLE_PROFILE
+                if (perf.watchdogGapMax_ms != Fprofile.watchdogGapMax())
+                    perf.watchdogGapMax_ms = Fprofile.watchdogGapMax();
+#endif
+                FmonitorMax_us = 0;
+            }
+
+            // check on wifi/cellular info
+            if (vitals.checkSignal_sec > 0 && (FlastSignalCheck == 0 || millis() - FlastSignalCheck >= 1000 * static_cast<system_tick_t>(vitals.checkSignal_sec)))
+            {
+                FlastSignalCheck = millis();
+                checkSignal();
+            }
+
+            // keep track of how expensive the check-in is
+            uint32_t duration = micros() - start;
+            if (duration > FmonitorMax_us)
+                FmonitorMax_us = duration;
+
             // check back in later
             FsystemCheckTimer.start(FcheckInterval);
         };
 
+        // hardware watchdog
+        on(FwatchdogTimer)
+        {
+            Watchdog.refresh();
+#ifdef SDDS_PARTICLE_PROFILE
+            Fprofile.watchdogRefreshed();
+#endif
+            FwatchdogTimer.start(FwatchdogInterval);
+        };
+
         // time sync
         on(FsyncTimer)
         {
             FresyncSysTime = true;
         };
+
+        // flash usage rescans
+        on(FflashRescanTimer)
+        {
+            checkFlashUsage();
+            FflashRescanTimer.start(FflashRescanInterval);
+        };
+        on(FflashScanTimer)
+        {
+            sdds_profile(FLASH_SCAN);
+            if (!stepFlashScan())
+                FflashScanTimer.start(FflashScanStepInterval);
+        };
+    }
+
+    // called with each memory stage to apply while memory is low (and with none once it recovered)
+    std::function<void(TmemoryStage::e)> FonMemoryPressure;
+
+    // called once the deferred loading of the state finished (see loadingState())
+    std::function<void()> FonStateLoaded;
+
+    /**
+     * @brief is part of the state still being loaded in the background?
+     */
+    bool loadingState()
+    {
+#ifdef SDDS_PARTICLE_STATE_JOURNAL
+        return FstateJournal.loading();
+#else
+        return false;
+#endif
+    }
+
+    bool memoryPressure()
+    {
+        return FmemoryStage != TmemoryStage::none;
+    }
+
+    TheapAccount &heapAccount()
+    {
+        return FheapAccount;
+    }
+
+#ifdef SDDS_PARTICLE_PROFILE
+    TloopProfile &profile()
+    {
+        return Fprofile;
+    }
+#endif
+
+    /**
+     * @brief record when a startup phase was reached (only the first time)
+     */
+    void markBootPhase(TbootPhase _phase)
+    {
+        if (FbootReached & (1 << _phase))
+            return;
+        FbootTimes[_phase] = millis();
+        FbootReached |= (1 << _phase);
+    }
+
+    // check if memory changed
+    void checkMemory()
+    {
+        uint32_t freeRAM = System.freeMemory();
+        if (vitals.freeRAM_byte != freeRAM)
+            vitals.freeRAM_byte = freeRAM;
+        handleMemoryPressure(freeRAM);
+    }
+
+    // check signal strength and network
+    void checkSignal()
+    {
+#if Wiring_WiFi && Wiring_WiFi == 1
+        if (WiFi.ready() && Particle.connectionInterface() == WiFi)
+        {
+            WiFiSignal rssi = WiFi.RSSI();
+            dtypes::uint8 sig = static_cast<dtypes::uint8>(round(rssi.getStrength()));
+            if (vitals.signal_percent != sig)
+                vitals.signal_percent = sig;
+            String ssid = WiFi.SSID();
+            if (vitals.network != ssid)
+                vitals.network = ssid;
+        }
+#endif
+
+#if Wiring_Cellular && Wiring_Cellular == 1
+        if (Cellular.ready() && Particle.connectionInterface() == Cellular)
+        {
+            CellularSignal rssi = Cellular.RSSI();
+            dtypes::uint8 sig = static_cast<dtypes::uint8>(round(rssi.getStrength()));
+            if (vitals.signal_percent != sig)
+                vitals.signal_percent = sig;
+            // FIXME: what's the cellular network equivalent to SSID?
+        }
+#endif
     }
 
     // capture name and store it
     void captureName(const char *topic, const char *data)
     {
+        markBootPhase(BOOT_NAME);
         if (strcmp(data, name) != 0)
         {
             name = data;
@@ -393,20 +1043,39 @@ public:
     // save state
     void saveState(bool _reset = false)
     {
+        sdds_profile(SAVE_STATE);
         // store current time as last save
         // FIXME: ideally suspend the signal trigger here until save has actually succeeded!
+        FsavingState = true;
         String oldLastSave = state.lastSave_dt;
         state.lastSave_dt = (_reset) ? "never" : Time.format(Time.now(), TIME_FORMAT_ISO8601_FULL);
+#ifdef SDDS_PARTICLE_STATE_JOURNAL
+        // append the changes to the journal (full snapshot on reset)
+        setupStateJournal();
+        if (FstateJournal.save(_reset) == TstateJournal::OK && saveSettings())
+        {
+            (_reset) ? state.status = Tstate::Tstatus::reset : state.status = Tstate::Tstatus::normal;
+            savedState();
+            state.size_byte = std::min<size_t>(FstateJournal.size(), UINT16_MAX);
+        }
+        else if (state.status != Tstate::Tstatus::failedSave)
+        {
+            // there was a problem!
+            state.lastSave_dt = oldLastSave;
+            state.status = Tstate::Tstatus::failedSave;
+        }
+#else
         // try to save state into EEPROM
         TmenuHandle *root = findRoot();
         sdds::paramSave::TparamStreamer ps;
         sdds::paramSave::Tstream s;
         ps.save(root, &s);
         // success?
-        if (ps.error() == TparamError::___)
+        if (ps.error() == TparamError::___ && saveSettings())
         {
             // save was successful (always set status here)
             (_reset) ? state.status = Tstate::Tstatus::reset : state.status = Tstate::Tstatus::normal;
+            savedState();
             state.size_byte = s.high();
         }
         else if (state.status != Tstate::Tstatus::failedSave)
@@ -416,11 +1085,45 @@ public:
             state.status = Tstate::Tstatus::failedSave;
         }
         state.error = ps.error();
+#endif
+        FsavingState = false;
+    }
+
+    // everything is saved --> nothing pending anymore
+    void savedState()
+    {
+        FautoSaveTimer.stop();
+        if (state.pending == TonOff::ON)
+            state.pending = TonOff::OFF;
     }
 
     // load state
     void loadState()
     {
+        sdds_profile(LOAD_STATE);
+        loadSettings();
+#ifdef SDDS_PARTICLE_STATE_JOURNAL
+        // latest snapshot + journal: SYSTEM right away, the rest in the background
+        setupStateJournal();
+        FloadingState = true;
+        TstateJournal::Tresult result = FstateJournal.load("SYSTEM");
+        if (result == TstateJournal::NO_STATE)
+        {
+            // no snapshot yet: import the state saved by paramSave (once, the snapshot is used from now on)
+            sdds::paramSave::TparamStreamer ps;
+            sdds::paramSave::Tstream s;
+            ps.load(findRoot(), &s);
+            if (ps.error() == TparamError::___)
+            {
+                bool saved = FstateJournal.save(true) == TstateJournal::OK;
+                Log.info("state journal: imported %u bytes of paramSave state (%s)", (unsigned)s.high(), (saved) ? "saved" : "not saved, retried at the next startup");
+            }
+        }
+        loadedState(result);
+        FloadingState = false;
+        if (FstateJournal.loading())
+            FstateLoadTimer.start(FstateLoadStepInterval);
+#else
         // try to load state into EEPROM
         TmenuHandle *root = findRoot();
         sdds::paramSave::TparamStreamer ps;
@@ -439,6 +1142,7 @@ public:
             state.status = Tstate::Tstatus::failedLoad;
         }
         state.error = ps.error();
+#endif
     }
 
     size_t bytesToSectors(size_t _bytes)
@@ -446,48 +1150,108 @@ public:
         return (_bytes + vitals.FflashSectorSize_byte - 1) / vitals.FflashSectorSize_byte;
     }
 
-    size_t getDirSectors(const char *path = "/")
+    // sectors used by a file (metadata + min 1 data sector), -1 = file does not exist
+    size_t fileSectors(int32_t _bytes)
     {
-        size_t sectors = 0;
-        DIR *dir = opendir(path);
-        if (!dir)
-            return 0;
+        return (_bytes < 0) ? 0 : 1 + max(1, (int)bytesToSectors(_bytes));
+    }
+
+    void setUsedSectors(size_t _usedSectors)
+    {
+        FusedSectors = _usedSectors;
+        size_t freeSectors = (FusedSectors < vitals.totalSectors) ? vitals.totalSectors - FusedSectors : 0;
+        if (vitals.freeSectors != freeSectors)
+        {
+            vitals.freeSectors = freeSectors;
+            vitals.freeFlash_byte = vitals.freeSectors * vitals.FflashSectorSize_byte;
+        }
+    }
 
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL)
+    /**
+     * @brief scan the next few directory entries of the background rescan
+     * @return whether the scan is complete
+     */
+    bool stepFlashScan()
+    {
+        for (size_t i = 0; i < FflashScanEntriesPerStep; ++i)
         {
+            // next directory
+            if (!FscanDir)
+            {
+                if (FscanDirs.empty())
+                {
+                    // done: LittleFS superblock (2 reserved root sectors) + root directory metadata sector + contents
+                    // plus the writes reported while scanning (a write to a file the scan had not reached yet
+                    // is over-counted until the next rescan, but writes to files already scanned are not lost)
+                    int32_t usedSectors = static_cast<int32_t>(2 + 1 + FscanSectors) + FscanDelta;
+                    FscanDelta = 0;
+                    setUsedSectors(usedSectors > 0 ? usedSectors : 0);
+                    return true;
+                }
+                FscanPath = FscanDirs.back();
+                FscanDirs.pop_back();
+                FscanDir = opendir(FscanPath.c_str());
+                continue;
+            }
+
+            // next entry
+            struct dirent *entry = readdir(FscanDir);
+            if (!entry)
+            {
+                closedir(FscanDir);
+                FscanDir = nullptr;
+                continue;
+            }
             if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
                 continue;
 
             char fullPath[128];
-            snprintf(fullPath, sizeof(fullPath), "%s/%s", path, entry->d_name);
+            bool rootDir = FscanPath.endsWith("/");
+            snprintf(fullPath, sizeof(fullPath), rootDir ? "%s%s" : "%s/%s", FscanPath.c_str(), entry->d_name);
 
             struct stat s;
             if (stat(fullPath, &s) == 0)
             {
                 if (S_ISDIR(s.st_mode))
                 {
-                    sectors += 1; // dir metadata sector
-                    sectors += getDirSectors(fullPath);
+                    FscanSectors += 1; // dir metadata sector
+                    FscanDirs.push_back(fullPath);
                 }
                 else
-                {
-                    sectors += 1;                                      // file metadata sector
-                    sectors += max(1, (int)bytesToSectors(s.st_size)); // min 1 data sector
-                }
+                    FscanSectors += fileSectors(s.st_size);
             }
         }
-        closedir(dir);
-        return sectors;
+        return false;
     }
 
-    // calculate flash use
+    /**
+     * @brief start a background rescan of the flash usage (if none is running)
+     */
     void checkFlashUsage()
     {
-        // LittleFS superblock (2 reserved root sectors) + root directory metadata sector
-        size_t usedSectors = 2 + 1 + getDirSectors("/");
-        vitals.freeSectors = (usedSectors < vitals.totalSectors) ? vitals.totalSectors - usedSectors : 0;
-        vitals.freeFlash_byte = vitals.freeSectors * vitals.FflashSectorSize_byte;
+        if (FscanDir || !FscanDirs.empty())
+            return; // already scanning
+        FscanSectors = 0;
+        FscanDelta = 0;
+        FscanDirs.push_back("/");
+        FflashScanTimer.start(0);
+    }
+
+    /**
+     * @brief report a file write to keep the flash usage up to date between rescans
+     * @param _oldBytes size of the file before the write (-1 if it did not exist)
+     * @param _newBytes size of the file after the write (-1 if it was deleted)
+     */
+    void reportFileSize(int32_t _oldBytes, int32_t _newBytes)
+    {
+        size_t oldSectors = fileSectors(_oldBytes);
+        size_t newSectors = fileSectors(_newBytes);
+        if (oldSectors == newSectors)
+            return;
+        // during a rescan, keep the delta to apply it to the scan result as well
+        if (FscanDir || !FscanDirs.empty())
+            FscanDelta += static_cast<int32_t>(newSectors) - static_cast<int32_t>(oldSectors);
+        setUsedSectors((FusedSectors + newSectors > oldSectors) ? FusedSectors + newSectors - oldSectors : 0);
     }
 };
 
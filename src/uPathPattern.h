@@ -0,0 +1,149 @@
+#pragma once
+#include "Particle.h"
+#include "uTypedef.h"
+#include <vector>
+
+/**
+ * @brief glob pattern for sdds variable paths, compiled once into its path segments
+ * within a segment '*' matches any number of characters and '?' a single character,
+ * a '**' segment matches any number of segments (including none)
+ * e.g. "adc*.voltage" or "pump.**"
+ */
+class TpathPattern
+{
+
+private:
+    // max depth of the variable paths that can be matched
+    constexpr static size_t MAX_DEPTH = 16;
+    constexpr static size_t NO_GLOBSTAR = static_cast<size_t>(-1);
+
+    std::vector<String> Fsegments;
+
+    bool isGlobstar(size_t _i) const
+    {
+        return Fsegments[_i] == "**";
+    }
+
+    /**
+     * @brief match a single segment ('*' and '?' wildcards)
+     */
+    static bool matchSegment(const char *_pat, const char *_str)
+    {
+        const char *star = nullptr;
+        const char *retry = nullptr;
+        while (*_str)
+        {
+            if (*_pat == '?' || (*_pat != '*' && *_pat == *_str))
+            {
+                _pat++;
+                _str++;
+            }
+            else if (*_pat == '*')
+            {
+                // remember the star and try matching nothing first
+                star = _pat++;
+                retry = _str;
+            }
+            else if (star)
+            {
+                // mismatch --> let the last star match one more character
+                _pat = star + 1;
+                _str = ++retry;
+            }
+            else
+                return false;
+        }
+        while (*_pat == '*')
+            _pat++;
+        return (*_pat == '\0');
+    }
+
+public:
+    // constructor
+    TpathPattern()
+    {
+    }
+    TpathPattern(const char *_pattern)
+    {
+        compile(_pattern);
+    }
+
+    /**
+     * @brief split the pattern into its segments
+     */
+    void compile(const char *_pattern)
+    {
+        Fsegments.clear();
+        if (!_pattern || *_pattern == '\0')
+            return;
+        const char *start = _pattern;
+        for (const char *c = _pattern;; ++c)
+        {
+            if (*c == '.' || *c == '\0')
+            {
+                Fsegments.push_back(String(start, c - start));
+                if (*c == '\0')
+                    break;
+                start = c + 1;
+            }
+        }
+    }
+
+    bool isEmpty() const
+    {
+        return Fsegments.empty();
+    }
+
+    /**
+     * @brief match a path that is already split into its segments
+     */
+    bool match(const char *const *_segments, size_t _n) const
+    {
+        // same backtracking as within a segment, with '**' as the star over whole segments
+        size_t p = 0;
+        size_t s = 0;
+        size_t star = NO_GLOBSTAR;
+        size_t retry = 0;
+        while (s < _n)
+        {
+            if (p < Fsegments.size() && isGlobstar(p))
+            {
+                star = p++;
+                retry = s;
+            }
+            else if (p < Fsegments.size() && matchSegment(Fsegments[p].c_str(), _segments[s]))
+            {
+                p++;
+                s++;
+            }
+            else if (star != NO_GLOBSTAR)
+            {
+                p = star + 1;
+                s = ++retry;
+            }
+            else
+                return false;
+        }
+        while (p < Fsegments.size() && isGlobstar(p))
+            p++;
+        return (p == Fsegments.size());
+    }
+
+    /**
+     * @brief match the path of an sdds variable (without building the path string)
+     */
+    bool match(Tdescr *_d) const
+    {
+        const char *segments[MAX_DEPTH];
+        size_t n = 0;
+        for (TmenuHandle *mh = _d->parent(); mh && mh->parent(); mh = mh->parent())
+            n++;
+        if (n + 1 > MAX_DEPTH)
+            return false;
+        segments[n] = _d->name();
+        size_t i = n;
+        for (TmenuHandle *mh = _d->parent(); mh && mh->parent(); mh = mh->parent())
+            segments[--i] = mh->name();
+        return match(segments, n + 1);
+    }
+};
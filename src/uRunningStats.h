@@ -56,6 +56,35 @@ public:
         FrunningW = TEMP;
     }
 
+    /**
+     * @brief merge the running stats of another (disjoint) set of values into this one
+     * pairwise combination of the weighted mean and squared deviations (Chan et al. 1979,
+     * see Schubert & Gertz 2018 for the weighted version):
+     * W = W_a + W_b
+     * M = M_a + (M_b - M_a) * W_b / W
+     * T = T_a + T_b + (M_b - M_a) * (M_b - M_a) * W_a * W_b / W
+     * @param _other the running stats to merge in
+     */
+    void merge(const TrunningStats &_other)
+    {
+        if (_other.Fcount == 0)
+            return;
+        if (Fcount == 0)
+        {
+            *this = _other;
+            return;
+        }
+        dtypes::float64 W = FrunningW + _other.FrunningW;
+        if (W > 0)
+        {
+            dtypes::float64 delta = _other.FrunningM - FrunningM;
+            FrunningT += _other.FrunningT + delta * delta * FrunningW * _other.FrunningW / W;
+            FrunningM += delta * _other.FrunningW / W;
+            FrunningW = W;
+        }
+        Fcount += _other.Fcount;
+    }
+
     dtypes::uint32 count()
     {
         return Fcount;
@@ -0,0 +1,696 @@
+#pragma once
+#include "Particle.h"
+#include "uTypedef.h"
+#include "uStringHash.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+/**
+ * @brief journaled store for the saveable (sdds::opt::saveval) variables
+ * the values are stored as text records keyed by a hash of the variable's path in two files:
+ * - a snapshot with all values, written alternately to two slots (A/B) with a sequence number and checksum
+ *   so that a power loss during a write always leaves the previous snapshot intact
+ * - a journal with only the values that changed since the snapshot (each record with its own checksum,
+ *   torn records at the end are ignored), compacted into a new snapshot once it gets too large
+ * the snapshot records are grouped by top level entry (e.g. SYSTEM) behind a small index so a group can
+ * be loaded right away and the others later, one at a time (see load() and loadNext())
+ * @note numeric values (and enums) are stored as their raw bytes (e.g. floats keep their full precision),
+ * the other types as their to_string() text restored via setValue(); each value starts with the type id
+ * so that records of variables that still exist with the same type survive changes to the structure
+ * (e.g. a version bump), records of variables whose type changed are skipped
+ * @note the path hashes must be unique, setup() fails (loudly) if two saveable variables collide
+ */
+class TstateJournal
+{
+
+public:
+    // load/save results
+    enum Tresult
+    {
+        OK = 0,          // loaded/saved
+        NO_STATE = 1,    // nothing stored yet
+        CORRUPT = 2,     // no valid snapshot (or group)
+        WRITE_ERROR = 3, // could not write to the file system
+        DUPLICATE = 4,   // two saveable variables (or top level entries) have the same path hash
+    };
+
+private:
+    constexpr static dtypes::uint32 SNAPSHOT_MAGIC = 0x53444453; // SDDS
+    constexpr static dtypes::uint32 JOURNAL_MAGIC = 0x5344444A;  // SDDJ
+    constexpr static size_t MAX_JOURNAL_SIZE = 4 * 1024;         // compact once the journal is larger
+    constexpr static size_t MAX_GROUPS = 256;                    // sanity limit for the index
+
+    struct TsnapshotHeader
+    {
+        dtypes::uint32 Fmagic;
+        dtypes::uint32 Fseq;    // sequence number (the highest valid one is the current snapshot)
+        dtypes::uint32 Fgroups; // number of index entries
+        dtypes::uint32 Fcrc;    // index checksum
+    };
+
+    // index entry of a group of records
+    struct Tgroup
+    {
+        dtypes::uint32 Fkey;    // hash of the top level entry's name
+        dtypes::uint32 Foffset; // position of the records (after the index)
+        dtypes::uint32 Flength; // bytes
+        dtypes::uint32 Fcrc;    // records checksum
+    };
+
+    struct TjournalHeader
+    {
+        dtypes::uint32 Fmagic;
+        dtypes::uint32 FbaseSeq; // sequence number of the snapshot the journal applies to
+    };
+
+    // saveable variable
+    struct Tvar
+    {
+        Tdescr *Fdescr;
+        dtypes::uint32 Fkey;       // hash of the path
+        dtypes::uint32 Fgroup;     // key of the group (top level entry)
+        dtypes::uint32 FsavedHash; // hash of the last saved value
+    };
+    std::vector<Tvar> Fvars;             // sorted by key
+    std::vector<dtypes::uint32> Fgroups; // group keys in tree order
+
+    String Fslots[2];
+    String Fjournal;
+    int Fslot = -1;           // current snapshot slot (-1 = none)
+    dtypes::uint32 Fseq = 0;  // current snapshot sequence number
+    size_t FsnapshotSize = 0; // bytes
+    size_t FjournalSize = 0;  // bytes (valid part)
+    bool FneedsCompaction = false;
+
+    // deferred loading
+    std::vector<Tgroup> FpendingGroups;         // groups still to load (next one at the back)
+    std::vector<dtypes::uint8> FpendingJournal; // valid journal records (without checksums)
+    size_t FrecordsOffset = 0;                  // file position of the snapshot records
+
+    bool Fduplicate = false; // path hash collision found by setup()
+
+    /**
+     * @brief CRC-32 (IEEE), bitwise to avoid the table
+     */
+    static dtypes::uint32 crc32(const dtypes::uint8 *_data, size_t _length, dtypes::uint32 _crc = 0)
+    {
+        _crc = ~_crc;
+        for (size_t i = 0; i < _length; ++i)
+        {
+            _crc ^= _data[i];
+            for (int b = 0; b < 8; ++b)
+                _crc = (_crc >> 1) ^ (0xEDB88320 & (0 - (_crc & 1)));
+        }
+        return ~_crc;
+    }
+
+    static dtypes::uint32 fold(dtypes::uint64 _hash)
+    {
+        return static_cast<dtypes::uint32>(_hash ^ (_hash >> 32));
+    }
+
+    static dtypes::uint32 valueHash(const std::vector<dtypes::uint8> &_value)
+    {
+        return fold(TstringHash::hash(reinterpret_cast<const char *>(_value.data()), _value.size()));
+    }
+
+    /**
+     * @brief the raw value of a numeric (or enum) variable, nullptr for the types stored as text
+     */
+    static dtypes::uint8 *rawValue(Tdescr *_d, size_t &_size)
+    {
+        void *raw = nullptr;
+        switch (_d->type())
+        {
+        case sdds::Ttype::UINT8:
+            raw = &static_cast<Tuint8 *>(_d)->Fvalue;
+            _size = sizeof(Tuint8::dtype);
+            break;
+        case sdds::Ttype::UINT16:
+            raw = &static_cast<Tuint16 *>(_d)->Fvalue;
+            _size = sizeof(Tuint16::dtype);
+            break;
+        case sdds::Ttype::UINT32:
+            raw = &static_cast<Tuint32 *>(_d)->Fvalue;
+            _size = sizeof(Tuint32::dtype);
+            break;
+        case sdds::Ttype::INT8:
+            raw = &static_cast<Tint8 *>(_d)->Fvalue;
+            _size = sizeof(Tint8::dtype);
+            break;
+        case sdds::Ttype::INT16:
+            raw = &static_cast<Tint16 *>(_d)->Fvalue;
+            _size = sizeof(Tint16::dtype);
+            break;
+        case sdds::Ttype::INT32:
+            raw = &static_cast<Tint32 *>(_d)->Fvalue;
+            _size = sizeof(Tint32::dtype);
+            break;
+        case sdds::Ttype::FLOAT32:
+            raw = &static_cast<Tfloat32 *>(_d)->Fvalue;
+            _size = sizeof(Tfloat32::dtype);
+            break;
+        case sdds::Ttype::FLOAT64:
+            raw = &static_cast<Tfloat64 *>(_d)->Fvalue;
+            _size = sizeof(Tfloat64::dtype);
+            break;
+        case sdds::Ttype::ENUM:
+            raw = static_cast<TenumBase *>(_d)->pValue();
+            _size = sizeof(dtypes::uint8);
+            break;
+        default:
+            _size = 0;
+            break;
+        }
+        return static_cast<dtypes::uint8 *>(raw);
+    }
+
+    /**
+     * @brief the stored form of a variable's value: type id + raw bytes (numeric) or text (other types)
+     */
+    static void encodeValue(Tdescr *_d, std::vector<dtypes::uint8> &_value)
+    {
+        _value.clear();
+        _value.push_back(_d->typeId());
+        size_t size;
+        const dtypes::uint8 *raw = rawValue(_d, size);
+        if (raw)
+            _value.insert(_value.end(), raw, raw + size);
+        else
+        {
+            dtypes::string text = _d->to_string();
+            _value.insert(_value.end(), text.c_str(), text.c_str() + text.length());
+        }
+    }
+
+    /**
+     * @brief restore a variable from its stored form (skipped if the type does not match)
+     */
+    static void decodeValue(Tdescr *_d, const dtypes::uint8 *_value, size_t _length)
+    {
+        if (_length == 0 || _value[0] != _d->typeId())
+            return;
+        size_t size;
+        dtypes::uint8 *raw = rawValue(_d, size);
+        if (!raw)
+            _d->setValue(String(reinterpret_cast<const char *>(_value) + 1, _length - 1).c_str());
+        else if (_length == 1 + size && memcmp(raw, _value + 1, size) != 0)
+        {
+            memcpy(raw, _value + 1, size);
+            _d->signalEvents();
+        }
+    }
+
+    void collectVars(TmenuHandle *_struct, dtypes::uint64 _parentHash, bool _topLevel, dtypes::uint32 _group)
+    {
+        for (auto it = _struct->iterator(); it.hasCurrent(); it.jumpToNext())
+        {
+            Tdescr *d = it.current();
+            if (!d)
+                continue;
+            TstringHash h(_parentHash);
+            if (!_topLevel)
+                h.add('.');
+            h.add(d->name(), strlen(d->name()));
+            dtypes::uint32 group = (_topLevel) ? fold(h.value()) : _group;
+            size_t before = Fvars.size();
+            if (d->isStruct())
+            {
+                TmenuHandle *mh = static_cast<Tstruct *>(d)->value();
+                if (mh)
+                    collectVars(mh, h.value(), false, group);
+            }
+            else if ((d->option() & sdds::opt::saveval) == sdds::opt::saveval)
+                Fvars.push_back({d, fold(h.value()), group, 0});
+            if (_topLevel && Fvars.size() > before)
+                Fgroups.push_back(group);
+        }
+    }
+
+    Tvar *findVar(dtypes::uint32 _key)
+    {
+        auto it = std::lower_bound(Fvars.begin(), Fvars.end(), _key, [](const Tvar &_v, dtypes::uint32 _k)
+                                   { return _v.Fkey < _k; });
+        return (it != Fvars.end() && it->Fkey == _key) ? &(*it) : nullptr;
+    }
+
+    static void appendRecord(std::vector<dtypes::uint8> &_buffer, dtypes::uint32 _key, const std::vector<dtypes::uint8> &_value)
+    {
+        dtypes::uint16 length = static_cast<dtypes::uint16>(std::min<size_t>(_value.size(), UINT16_MAX));
+        const dtypes::uint8 *key = reinterpret_cast<const dtypes::uint8 *>(&_key);
+        const dtypes::uint8 *len = reinterpret_cast<const dtypes::uint8 *>(&length);
+        _buffer.insert(_buffer.end(), key, key + sizeof(_key));
+        _buffer.insert(_buffer.end(), len, len + sizeof(length));
+        _buffer.insert(_buffer.end(), _value.begin(), _value.begin() + length);
+    }
+
+    /**
+     * @brief parse the record at the start of _data
+     * @return the size of the record (0 if it's incomplete)
+     */
+    static size_t parseRecord(const dtypes::uint8 *_data, size_t _length, dtypes::uint32 &_key, const dtypes::uint8 *&_value, dtypes::uint16 &_valueLength)
+    {
+        dtypes::uint16 length;
+        if (_length < sizeof(_key) + sizeof(length))
+            return 0;
+        memcpy(&_key, _data, sizeof(_key));
+        memcpy(&length, _data + sizeof(_key), sizeof(length));
+        size_t size = sizeof(_key) + sizeof(length) + length;
+        if (_length < size)
+            return 0;
+        _value = _data + sizeof(_key) + sizeof(length);
+        _valueLength = length;
+        return size;
+    }
+
+    /**
+     * @brief apply the records that belong to a group
+     */
+    void applyRecords(const std::vector<dtypes::uint8> &_records, dtypes::uint32 _group)
+    {
+        dtypes::uint32 key;
+        const dtypes::uint8 *value;
+        dtypes::uint16 length;
+        for (size_t pos = 0, size; (size = parseRecord(_records.data() + pos, _records.size() - pos, key, value, length)) > 0; pos += size)
+        {
+            // records of variables that no longer exist are skipped
+            Tvar *var = findVar(key);
+            if (var && var->Fgroup == _group)
+                decodeValue(var->Fdescr, value, length);
+        }
+    }
+
+    static bool readFile(const char *_path, std::vector<dtypes::uint8> &_data)
+    {
+        int fd = open(_path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat s;
+        bool ok = (fstat(fd, &s) == 0);
+        if (ok)
+        {
+            _data.resize(s.st_size);
+            ok = (s.st_size == 0 || read(fd, _data.data(), s.st_size) == s.st_size);
+        }
+        close(fd);
+        return ok;
+    }
+
+    static bool readAt(int _fd, size_t _offset, void *_data, size_t _length)
+    {
+        if (lseek(_fd, _offset, SEEK_SET) != static_cast<off_t>(_offset))
+            return false;
+        return _length == 0 || read(_fd, _data, _length) == static_cast<ssize_t>(_length);
+    }
+
+    bool writeFile(const char *_path, int _flags, const dtypes::uint8 *_data, size_t _length)
+    {
+        int fd = open(_path, _flags, 0644);
+        if (fd < 0)
+            return false;
+        bool ok = (write(fd, _data, _length) == static_cast<ssize_t>(_length));
+        ok = (fsync(fd) == 0) && ok;
+        close(fd);
+        return ok;
+    }
+
+    /**
+     * @brief read the records of one group from an open snapshot file
+     * @return whether the records are complete and valid
+     */
+    static bool readRecords(int _fd, size_t _recordsOffset, const Tgroup &_group, std::vector<dtypes::uint8> &_records)
+    {
+        _records.resize(_group.Flength);
+        return readAt(_fd, _recordsOffset + _group.Foffset, _records.data(), _records.size()) &&
+               crc32(_records.data(), _records.size()) == _group.Fcrc;
+    }
+
+    /**
+     * @brief read the header and index of a snapshot slot and check the records of all its groups
+     * @return whether the slot holds a complete and valid snapshot
+     */
+    bool readSnapshotIndex(int _slot, TsnapshotHeader &_header, std::vector<Tgroup> &_index)
+    {
+        int fd = open(Fslots[_slot].c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        bool ok = readAt(fd, 0, &_header, sizeof(_header)) && _header.Fmagic == SNAPSHOT_MAGIC && _header.Fgroups <= MAX_GROUPS;
+        if (ok)
+        {
+            _index.resize(_header.Fgroups);
+            ok = readAt(fd, sizeof(_header), _index.data(), _index.size() * sizeof(Tgroup)) &&
+                 crc32(reinterpret_cast<const dtypes::uint8 *>(_index.data()), _index.size() * sizeof(Tgroup)) == _header.Fcrc;
+        }
+        // a snapshot with a damaged group is not used (the other slot is, if it's intact)
+        std::vector<dtypes::uint8> records;
+        size_t recordsOffset = sizeof(_header) + _index.size() * sizeof(Tgroup);
+        for (size_t i = 0; ok && i < _index.size(); ++i)
+            ok = readRecords(fd, recordsOffset, _index[i], records);
+        close(fd);
+        return ok;
+    }
+
+    /**
+     * @brief read the records of one group of the current snapshot
+     * @return whether the records are complete and valid
+     */
+    bool readGroup(const Tgroup &_group, std::vector<dtypes::uint8> &_records)
+    {
+        int fd = open(Fslots[Fslot].c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        bool ok = readRecords(fd, FrecordsOffset, _group, _records);
+        close(fd);
+        return ok;
+    }
+
+    /**
+     * @brief load one group: its snapshot records, then its journal records
+     */
+    bool loadGroup(const Tgroup &_group)
+    {
+        std::vector<dtypes::uint8> records;
+        bool ok = readGroup(_group, records);
+        if (ok)
+            applyRecords(records, _group.Fkey);
+        else
+            FneedsCompaction = true; // rewrite the snapshot on the next save
+        applyRecords(FpendingJournal, _group.Fkey);
+
+        // what's loaded is what's saved
+        std::vector<dtypes::uint8> value;
+        for (Tvar &var : Fvars)
+        {
+            if (var.Fgroup != _group.Fkey)
+                continue;
+            encodeValue(var.Fdescr, value);
+            var.FsavedHash = valueHash(value);
+        }
+        return ok;
+    }
+
+    /**
+     * @brief read the valid records of the journal (if it belongs to the current snapshot)
+     */
+    void readJournal()
+    {
+        std::vector<dtypes::uint8> journal;
+        TjournalHeader header;
+        FjournalSize = 0;
+        FpendingJournal.clear();
+        if (!readFile(Fjournal.c_str(), journal) || journal.size() < sizeof(header))
+        {
+            FneedsCompaction = true;
+            return;
+        }
+        memcpy(&header, journal.data(), sizeof(header));
+        if (header.Fmagic != JOURNAL_MAGIC || header.FbaseSeq != Fseq)
+        {
+            FneedsCompaction = true;
+            return;
+        }
+        dtypes::uint32 key;
+        const dtypes::uint8 *value;
+        dtypes::uint16 length;
+        size_t pos = sizeof(header);
+        for (size_t size; (size = parseRecord(journal.data() + pos, journal.size() - pos, key, value, length)) > 0;)
+        {
+            // record checksum
+            dtypes::uint32 crc;
+            if (journal.size() - pos < size + sizeof(crc))
+                break;
+            memcpy(&crc, journal.data() + pos + size, sizeof(crc));
+            if (crc32(journal.data() + pos, size) != crc)
+                break;
+            FpendingJournal.insert(FpendingJournal.end(), journal.begin() + pos, journal.begin() + pos + size);
+            pos += size + sizeof(crc);
+        }
+        FjournalSize = pos;
+        // torn record at the end? --> compact on the next save
+        FneedsCompaction = (pos != journal.size());
+    }
+
+    /**
+     * @brief start a new (empty) journal for the current snapshot
+     */
+    bool resetJournal()
+    {
+        TjournalHeader header{JOURNAL_MAGIC, Fseq};
+        int32_t oldSize = fileSize(Fjournal.c_str());
+        bool ok = writeFile(Fjournal.c_str(), O_WRONLY | O_CREAT | O_TRUNC, reinterpret_cast<const dtypes::uint8 *>(&header), sizeof(header));
+        FjournalSize = (ok) ? sizeof(header) : 0;
+        reportFileSize(oldSize, fileSize(Fjournal.c_str()));
+        return ok;
+    }
+
+    /**
+     * @brief write all values (grouped, behind the index) to the inactive slot, then start a new journal
+     */
+    bool writeSnapshot()
+    {
+        std::vector<Tgroup> index;
+        std::vector<dtypes::uint8> records;
+        std::vector<dtypes::uint32> hashes(Fvars.size());
+        std::vector<dtypes::uint8> value;
+        for (dtypes::uint32 group : Fgroups)
+        {
+            size_t start = records.size();
+            for (size_t i = 0; i < Fvars.size(); ++i)
+            {
+                if (Fvars[i].Fgroup != group)
+                    continue;
+                encodeValue(Fvars[i].Fdescr, value);
+                hashes[i] = valueHash(value);
+                appendRecord(records, Fvars[i].Fkey, value);
+            }
+            index.push_back({group, static_cast<dtypes::uint32>(start), static_cast<dtypes::uint32>(records.size() - start), crc32(records.data() + start, records.size() - start)});
+        }
+        const dtypes::uint8 *indexBytes = reinterpret_cast<const dtypes::uint8 *>(index.data());
+        size_t indexSize = index.size() * sizeof(Tgroup);
+        TsnapshotHeader header{SNAPSHOT_MAGIC, Fseq + 1, static_cast<dtypes::uint32>(index.size()), crc32(indexBytes, indexSize)};
+        const dtypes::uint8 *headerBytes = reinterpret_cast<const dtypes::uint8 *>(&header);
+        records.insert(records.begin(), indexBytes, indexBytes + indexSize);
+        records.insert(records.begin(), headerBytes, headerBytes + sizeof(header));
+
+        int slot = (Fslot == 0) ? 1 : 0;
+        int32_t oldSize = fileSize(Fslots[slot].c_str());
+        bool ok = writeFile(Fslots[slot].c_str(), O_WRONLY | O_CREAT | O_TRUNC, records.data(), records.size());
+        reportFileSize(oldSize, fileSize(Fslots[slot].c_str()));
+        if (!ok)
+            return false;
+
+        // the new snapshot is complete --> it's the current one now
+        Fslot = slot;
+        Fseq = header.Fseq;
+        FsnapshotSize = records.size();
+        FrecordsOffset = sizeof(header) + indexSize;
+        for (size_t i = 0; i < Fvars.size(); ++i)
+            Fvars[i].FsavedHash = hashes[i];
+        FneedsCompaction = false;
+        return resetJournal();
+    }
+
+    static int32_t fileSize(const char *_path)
+    {
+        struct stat s;
+        return (stat(_path, &s) == 0) ? static_cast<int32_t>(s.st_size) : -1;
+    }
+
+    void reportFileSize(int32_t _oldBytes, int32_t _newBytes)
+    {
+        if (FonFileSize)
+            FonFileSize(_oldBytes, _newBytes);
+    }
+
+public:
+    // called with the old and new size of a file after each write (-1 = file does not exist)
+    std::function<void(int32_t, int32_t)> FonFileSize;
+
+    // constructor
+    TstateJournal()
+    {
+    }
+
+    /**
+     * @brief collect the saveable variables of the tree and set the file locations
+     */
+    void setup(TmenuHandle *_root, const char *_dir = "/sdds")
+    {
+        Fvars.clear();
+        Fgroups.clear();
+        collectVars(_root, TstringHash().value(), true, 0);
+        std::sort(Fvars.begin(), Fvars.end(), [](const Tvar &_a, const Tvar &_b)
+                  { return _a.Fkey < _b.Fkey; });
+
+        // the hashes are the only identity of a record, a collision would silently mix up values
+        Fduplicate = false;
+        for (size_t i = 1; i < Fvars.size(); ++i)
+        {
+            if (Fvars[i].Fkey != Fvars[i - 1].Fkey)
+                continue;
+            Log.error("state journal: %s and %s have the same path hash", Fvars[i - 1].Fdescr->name(), Fvars[i].Fdescr->name());
+            Fduplicate = true;
+        }
+        std::vector<dtypes::uint32> groups(Fgroups);
+        std::sort(groups.begin(), groups.end());
+        if (std::adjacent_find(groups.begin(), groups.end()) != groups.end())
+        {
+            Log.error("state journal: two top level entries have the same name hash");
+            Fduplicate = true;
+        }
+
+        mkdir(_dir, 0755);
+        Fslots[0] = String(_dir) + "/stateA";
+        Fslots[1] = String(_dir) + "/stateB";
+        Fjournal = String(_dir) + "/journal";
+    }
+
+    bool isSetup() const { return Fjournal.length() > 0; }
+
+    /**
+     * @brief find the latest complete and valid snapshot and restore the values of the first group (plus its journal records)
+     * @param _first name of the top level entry to load right away; if nullptr, all groups are loaded right away,
+     * otherwise the other groups are loaded by loadNext() (or at the latest before the next save)
+     */
+    Tresult load(const char *_first = nullptr)
+    {
+        if (Fduplicate)
+            return DUPLICATE;
+
+        // latest valid snapshot (all group checksums are checked before a slot is picked)
+        TsnapshotHeader header;
+        std::vector<Tgroup> candidate;
+        FpendingGroups.clear();
+        FpendingJournal.clear();
+        Fslot = -1;
+        Fseq = 0;
+        for (int slot = 0; slot < 2; ++slot)
+        {
+            if (readSnapshotIndex(slot, header, candidate) && (Fslot < 0 || header.Fseq > Fseq))
+            {
+                Fslot = slot;
+                Fseq = header.Fseq;
+                FpendingGroups.swap(candidate);
+            }
+        }
+        if (Fslot < 0)
+        {
+            FneedsCompaction = true; // start with a snapshot on the next save
+            bool exists = fileSize(Fslots[0].c_str()) >= 0 || fileSize(Fslots[1].c_str()) >= 0;
+            return (exists) ? CORRUPT : NO_STATE;
+        }
+        FsnapshotSize = std::max<int32_t>(fileSize(Fslots[Fslot].c_str()), 0);
+        FrecordsOffset = sizeof(header) + FpendingGroups.size() * sizeof(Tgroup);
+        readJournal();
+
+        // the next group to load is at the back
+        std::reverse(FpendingGroups.begin(), FpendingGroups.end());
+        if (_first == nullptr)
+        {
+            Tresult result = OK;
+            while (loading())
+            {
+                if (loadNext() != OK)
+                    result = CORRUPT;
+            }
+            return result;
+        }
+        dtypes::uint32 first = fold(TstringHash::hash(_first));
+        auto it = std::find_if(FpendingGroups.begin(), FpendingGroups.end(), [first](const Tgroup &_g)
+                               { return _g.Fkey == first; });
+        if (it == FpendingGroups.end())
+            return OK;
+        std::rotate(it, it + 1, FpendingGroups.end());
+        return loadNext();
+    }
+
+    /**
+     * @brief are there still groups to load?
+     */
+    bool loading() const { return !FpendingGroups.empty(); }
+
+    /**
+     * @brief load the next pending group
+     * @return CORRUPT if the group's records were invalid (its variables keep their values)
+     */
+    Tresult loadNext()
+    {
+        if (!loading())
+            return OK;
+        Tgroup group = FpendingGroups.back();
+        FpendingGroups.pop_back();
+        bool ok = loadGroup(group);
+        if (!loading())
+        {
+            // all done, release the journal records
+            FpendingJournal.clear();
+            FpendingJournal.shrink_to_fit();
+        }
+        return (ok) ? OK : CORRUPT;
+    }
+
+    /**
+     * @brief save the values that changed since the last save (or all of them)
+     * @param _full write a complete snapshot (e.g. after a reset)
+     */
+    Tresult save(bool _full = false)
+    {
+        if (Fduplicate)
+            return DUPLICATE;
+
+        // never overwrite values that are not loaded yet
+        while (loading())
+            loadNext();
+
+        if (_full || Fslot < 0 || FneedsCompaction)
+            return (writeSnapshot()) ? OK : WRITE_ERROR;
+
+        // changed values
+        std::vector<dtypes::uint8> records;
+        std::vector<std::pair<size_t, dtypes::uint32>> changed; // var, hash of the new value
+        std::vector<dtypes::uint8> value;
+        for (size_t i = 0; i < Fvars.size(); ++i)
+        {
+            encodeValue(Fvars[i].Fdescr, value);
+            dtypes::uint32 hash = valueHash(value);
+            if (hash == Fvars[i].FsavedHash)
+                continue;
+            size_t start = records.size();
+            appendRecord(records, Fvars[i].Fkey, value);
+            dtypes::uint32 crc = crc32(records.data() + start, records.size() - start);
+            records.insert(records.end(), reinterpret_cast<const dtypes::uint8 *>(&crc), reinterpret_cast<const dtypes::uint8 *>(&crc) + sizeof(crc));
+            changed.push_back({i, hash});
+        }
+        if (changed.empty())
+            return OK;
+
+        // journal too large? --> compact into a new snapshot instead
+        if (FjournalSize + records.size() > MAX_JOURNAL_SIZE)
+            return (writeSnapshot()) ? OK : WRITE_ERROR;
+
+        int32_t oldSize = fileSize(Fjournal.c_str());
+        bool ok = writeFile(Fjournal.c_str(), O_WRONLY | O_APPEND, records.data(), records.size());
+        reportFileSize(oldSize, fileSize(Fjournal.c_str()));
+        if (!ok)
+        {
+            // partially written records are dropped on load, start clean with the next save
+            FneedsCompaction = true;
+            return WRITE_ERROR;
+        }
+        FjournalSize += records.size();
+        for (auto &c : changed)
+            Fvars[c.first].FsavedHash = c.second;
+        return OK;
+    }
+
+    /**
+     * @brief bytes currently used by the state (snapshot + journal)
+     */
+    size_t size() const
+    {
+        return FsnapshotSize + FjournalSize;
+    }
+};
@@ -0,0 +1,78 @@
+#pragma once
+#include "uTypedef.h"
+
+/**
+ * @brief fast non-cryptographic string hash (64-bit FNV-1a)
+ * for change detection and lookups, NOT for anything security related
+ * see http://www.isthe.com/chongo/tech/comp/fnv/ for the algorithm
+ */
+class TstringHash
+{
+
+private:
+    inline static const dtypes::uint64 FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+    inline static const dtypes::uint64 FNV_PRIME = 0x100000001b3ULL;
+
+    // running hash
+    dtypes::uint64 Fhash = FNV_OFFSET_BASIS;
+
+public:
+    // constructor
+    TstringHash()
+    {
+    }
+
+    // continue from a previous hash value (e.g. hash of a prefix)
+    explicit TstringHash(dtypes::uint64 _hash) : Fhash(_hash)
+    {
+    }
+
+    /**
+     * @brief add a single character to the running hash
+     */
+    void add(char _c)
+    {
+        Fhash ^= static_cast<dtypes::uint8>(_c);
+        Fhash *= FNV_PRIME;
+    }
+
+    /**
+     * @brief add a number of characters to the running hash
+     */
+    void add(const char *_str, size_t _len)
+    {
+        for (size_t i = 0; i < _len; ++i)
+            add(_str[i]);
+    }
+
+    dtypes::uint64 value()
+    {
+        return Fhash;
+    }
+
+    void reset()
+    {
+        Fhash = FNV_OFFSET_BASIS;
+    }
+
+    /**
+     * @brief hash of _len characters of _str
+     */
+    static dtypes::uint64 hash(const char *_str, size_t _len)
+    {
+        TstringHash h;
+        h.add(_str, _len);
+        return h.value();
+    }
+
+    /**
+     * @brief hash of a null-terminated string
+     */
+    static dtypes::uint64 hash(const char *_str)
+    {
+        TstringHash h;
+        for (; *_str; ++_str)
+            h.add(*_str);
+        return h.value();
+    }
+};